@@ -1,6 +1,9 @@
 #include "extlz4.h"
+#define LZ4_STATIC_LINKING_ONLY
 #include <lz4.h>
+#define LZ4_HC_STATIC_LINKING_ONLY
 #include <lz4hc.h>
+#include "hashargs.h"
 
 #define RDOCFAKE(code)
 
@@ -32,7 +35,7 @@ aux_LZ4_compress_fast_continue_nogvl(va_list *vp)
 static int
 aux_LZ4_compress_fast_continue(void *context, const char *src, char *dest, int srcsize, int destsize, int acceleration)
 {
-    return (int)(intptr_t)aux_thread_call_without_gvl(
+    return (int)(intptr_t)aux_thread_call_without_gvl2(
             aux_LZ4_compress_fast_continue_nogvl, NULL,
             context, src, dest, srcsize, destsize, acceleration);
 }
@@ -45,18 +48,22 @@ aux_LZ4_compressHC_continue_nogvl(va_list *vp)
     char *dest = va_arg(*vp, char *);
     int srcsize = va_arg(*vp, int);
     int destsize = va_arg(*vp, int);
+    int level = va_arg(*vp, int);
 
+    LZ4_setCompressionLevel(context, level);
     // NOTE: キャストについては aux_LZ4_decompress_safe_continue_nogvl() を参照されたし
     return (void *)(intptr_t)LZ4_compress_HC_continue(context, src, dest, srcsize, destsize);
 }
 
+/*
+ * level は今回の呼び出しで用いる圧縮レベル。
+ */
 static int
-aux_LZ4_compressHC_continue(void *context, const char *src, char *dest, int srcsize, int destsize, int acceleration__ignored__)
+aux_LZ4_compressHC_continue(void *context, const char *src, char *dest, int srcsize, int destsize, int level)
 {
-    (void)acceleration__ignored__;
-    return (int)(intptr_t)aux_thread_call_without_gvl(
+    return (int)(intptr_t)aux_thread_call_without_gvl2(
             aux_LZ4_compressHC_continue_nogvl, NULL,
-            context, src, dest, srcsize, destsize);
+            context, src, dest, srcsize, destsize, level);
 }
 
 static void *
@@ -73,12 +80,20 @@ aux_LZ4_decompress_safe_continue_nogvl(va_list *vp)
     return (void *)(intptr_t)LZ4_decompress_safe_continue(context, src, dest, srcsize, maxsize);
 }
 
+/*
+ * 割り込みは、呼び出し元が履歴を更新した後で処理すること。
+ */
 static int
 aux_LZ4_decompress_safe_continue(LZ4_streamDecode_t *context, const char *src, char *dest, int srcsize, int maxsize)
 {
-    return (int)(intptr_t)aux_thread_call_without_gvl(
-            aux_LZ4_decompress_safe_continue_nogvl, NULL,
-            context, src, dest, srcsize, maxsize);
+    void *s;
+    while (!aux_thread_try_without_gvl(&s,
+                aux_LZ4_decompress_safe_continue_nogvl, NULL,
+                context, src, dest, srcsize, maxsize)) {
+        /* 呼ばれなかった場合は履歴を更新していない */
+        rb_thread_check_ints();
+    }
+    return (int)(intptr_t)s;
 }
 
 static inline size_t
@@ -92,11 +107,16 @@ aux_lz4_expandsize(const char **p, const char *end, size_t size)
         }
     }
 
-    rb_raise(extlz4_eError, "encounted invalid end of sequence");
+    return SIZE_MAX;
 }
 
+/*
+ * lz4 シーケンスを走査して伸張後のバイト数を返す。不正なシーケンスであれば SIZE_MAX を返す。
+ *
+ * ruby の API を呼び出さないため、GVL を手放した状態でも呼び出せる。
+ */
 static inline size_t
-aux_lz4_scanseq(const char *p, const char *end, size_t *linksize)
+aux_lz4_scanseq_nogvl(const char *p, const char *end, size_t *linksize)
 {
     size_t size = 0;
     while (AUX_LIKELY(p < end)) {
@@ -104,6 +124,7 @@ aux_lz4_scanseq(const char *p, const char *end, size_t *linksize)
         size_t s = token >> 4;
         if (AUX_LIKELY(s == 15)) {
             s = aux_lz4_expandsize(&p, end, s);
+            if (AUX_UNLIKELY(s == SIZE_MAX)) { return SIZE_MAX; }
         }
         size += s;
         p += s;
@@ -136,11 +157,23 @@ aux_lz4_scanseq(const char *p, const char *end, size_t *linksize)
         s = token & 0x0f;
         if (AUX_LIKELY(s == 15)) {
             s = aux_lz4_expandsize(&p, end, s);
+            if (AUX_UNLIKELY(s == SIZE_MAX)) { return SIZE_MAX; }
         }
         size += s + 4;
     }
 
-    rb_raise(extlz4_eError, "encounted invalid end of sequence");
+    return SIZE_MAX;
+}
+
+static inline size_t
+aux_lz4_scanseq(const char *p, const char *end, size_t *linksize)
+{
+    size_t size = aux_lz4_scanseq_nogvl(p, end, linksize);
+    if (size == SIZE_MAX) {
+        rb_raise(extlz4_eError, "encounted invalid end of sequence");
+    }
+
+    return size;
 }
 
 /*
@@ -191,8 +224,170 @@ aux_lz4_compressbound(VALUE src)
     return LZ4_compressBound(rb_long2int(RSTRING_LEN(src)));
 }
 
+/*
+ * size_prefix: true の場合、ブロックの先頭に伸張後の長さを符号なし LEB128 で置く。
+ *
+ * LZ4_MAX_INPUT_SIZE は 31 ビットに収まるため、最大で 5 バイトとなる。
+ */
+enum { AUX_VARINT_MAX = 5 };
+
+static inline size_t
+aux_varint_write(char *p, size_t n)
+{
+    char *q = p;
+    while (n >= 0x80) {
+        *q ++ = (char)((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    *q ++ = (char)n;
+
+    return q - p;
+}
+
+/*
+ * 戻り値は読み込んだバイト数。不正な場合は 0 を返す。
+ */
+static inline size_t
+aux_varint_read(const char *p, const char *end, size_t *n)
+{
+    size_t v = 0;
+    int i;
+    for (i = 0; i < AUX_VARINT_MAX && p + i < end; i ++) {
+        unsigned char b = (unsigned char)p[i];
+        v |= (size_t)(b & 0x7f) << (i * 7);
+        if (!(b & 0x80)) {
+            if (v > LZ4_MAX_INPUT_SIZE) {
+                return 0;
+            }
+            *n = v;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * 長さ前置つきのブロックを読み、前置を除いたブロックを *srcp と *srcsize に、伸張後の長さを返す。
+ *
+ * 前置は出力先の確保に使われるため、残りの圧縮データから LZ4 が伸張しうる最大の長さ
+ * (1 バイトあたり 255 バイト、加えて末尾のリテラル) を超えるものは不正とする。
+ */
+static size_t
+aux_lz4_prefixed(const char **srcp, size_t *srcsize)
+{
+    size_t size;
+    size_t n = aux_varint_read(*srcp, *srcp + *srcsize, &size);
+    if (n == 0) {
+        rb_raise(extlz4_eError, "invalid size prefix");
+    }
+    *srcp += n;
+    *srcsize -= n;
+
+    if (size > 16 && (size - 16 + 254) / 255 > *srcsize) {
+        rb_raise(extlz4_eError,
+                 "size prefix is too large for the block (prefix %"PRIuSIZE", block %"PRIuSIZE" bytes)",
+                 size, *srcsize);
+    }
+
+    return size;
+}
+
+static size_t
+aux_lz4_prefixsize(VALUE str)
+{
+    const char *p;
+    size_t size;
+    RSTRING_GETMEM(str, p, size);
+
+    return aux_lz4_prefixed(&p, &size);
+}
+
+/*
+ * dest の先頭に伸張後の長さ size を書き込み、そのバイト数を返す。
+ */
+static size_t
+aux_lz4_put_prefix(VALUE dest, size_t maxsize, size_t size)
+{
+    char buf[AUX_VARINT_MAX];
+    size_t n = aux_varint_write(buf, size);
+    if (n > maxsize) {
+        rb_raise(extlz4_eError,
+                "destsize too small for size prefix (given destsize is %"PRIuSIZE")",
+                maxsize);
+    }
+    memcpy(RSTRING_PTR(dest), buf, n);
+
+    return n;
+}
+
+/*
+ * 長さ前置を取り除き、伸張後の長さを *maxsize に設定してから返す。
+ */
+static size_t
+aux_lz4_getprefix(const char **srcp, size_t *srcsize, size_t *maxsize)
+{
+    size_t size = aux_lz4_prefixed(srcp, srcsize);
+    if (size > *maxsize) {
+        rb_raise(extlz4_eError,
+                "max_dest_size is too small (given %"PRIuSIZE", but size prefix is %"PRIuSIZE")",
+                *maxsize, size);
+    }
+    *maxsize = size;
+
+    return size;
+}
+
+static inline void
+aux_lz4_checkprefix(VALUE dest, size_t expected)
+{
+    if (expected != SIZE_MAX && (size_t)RSTRING_LEN(dest) != expected) {
+        rb_raise(extlz4_eError,
+                "decoded size mismatch (expected %"PRIuSIZE", but %ld bytes) - corrupt lz4'd data",
+                expected, RSTRING_LEN(dest));
+    }
+}
+
+static inline size_t
+aux_lz4_compressbound_prefixed(VALUE src)
+{
+    return aux_lz4_compressbound(src) + AUX_VARINT_MAX;
+}
+
+/*
+ * 一度きりの処理でキーワード引数として与えられた size_prefix: を取り除く。
+ *
+ * LZ4.block_encode などを経由すると通常の Hash として渡ってくるため、末尾の Hash を取り出す。
+ */
+static int
+aux_scan_size_prefix(int *argc, VALUE argv[])
+{
+    VALUE opts = Qnil, prefixed;
+    /* rb_scan_args(":") と同じく、キーワード引数として与えられた Hash に限る */
+    if (*argc > 0 && rb_keyword_given_p() && RB_TYPE_P(argv[*argc - 1], RUBY_T_HASH)) {
+        opts = argv[-- *argc];
+    }
+    RBX_SCANHASH(opts, Qnil,
+            RBX_SCANHASH_ARGS("size_prefix", &prefixed, Qfalse));
+
+    return RTEST(prefixed);
+}
+
 enum {
     MAX_PREDICT_SIZE = 65536,
+
+    /* これ以上の長さであれば、一度きりの圧縮処理で GVL を手放す */
+    AUX_ONESHOT_NOGVL_SIZE = 64 * 1024,     /* 64 KiB */
+    AUX_ONESHOT_NOGVL_SIZE_HC = 4 * 1024,   /* 4 KiB */
+
+    /*
+     * ring: true の場合の、リングバッファを経由する入力 (伸張器では出力) の最大長とリングバッファの長さ。
+     *
+     * 先頭に戻って書き込むデータが直前の 64 KiB の履歴と重ならないように、
+     * リングバッファは 64 KiB と最大長の2倍を合わせた長さとする。
+     */
+    AUX_RING_INPUT_MAX = 128 * 1024,                        /* 128 KiB */
+    AUX_RING_SIZE = 64 * 1024 + AUX_RING_INPUT_MAX * 2,     /* 320 KiB */
 };
 
 static inline VALUE
@@ -328,6 +523,11 @@ struct blockencoder
     const struct blockencoder_traits *traits;
     VALUE predict;
     int level;
+    double deadline;    /* 0 以外であれば一回の update で圧縮に費やす秒数の目安 */
+    double comprate;    /* 本来の圧縮レベルで 1 バイトの圧縮に要した秒数の見積もり */
+    char *ring;         /* ring: true の場合の入力の履歴 (AUX_RING_SIZE バイト) */
+    size_t ringoff;     /* 次の入力を書き込む ring の位置 */
+    int sizeprefix;     /* 真であれば出力の先頭に伸張後の長さを置く */
     int prefixsize;
     char prefix[1 << 16]; /* 64 KiB; LZ4_loadDict, LZ4_saveDict */
 };
@@ -346,6 +546,7 @@ blkenc_free(void *pp)
     if (p->context && p->traits) {
         p->traits->free(p->context);
     }
+    xfree(p->ring);
     memset(p, 0, sizeof(*p));
     xfree(p);
 }
@@ -445,11 +646,13 @@ blkenc_setup(int argc, VALUE argv[], struct blockencoder *p, VALUE predict)
     }
 
     p->prefixsize = p->traits->savedict(p->context, p->prefix, sizeof(p->prefix));
+    p->ringoff = 0;
+    p->comprate = 0;
 }
 
 /*
  * call-seq:
- *  initialize(level = nil, predict = nil)
+ *  initialize(level = nil, predict = nil, deadline: nil, ring: false, size_prefix: false)
  *
  * [RETURN]
  *      self
@@ -461,6 +664,34 @@ blkenc_setup(int argc, VALUE argv[], struct blockencoder *p, VALUE predict)
  *
  * [predict]
  *      Preset dictionary.
+ *
+ * [deadline: nil (Float)]
+ *      一回の #update で圧縮に費やす秒数の目安を指定します。
+ *
+ *      高効率圧縮の場合に、それまでの圧縮速度から期限に間に合わないと見込まれれば、
+ *      その #update に限って LZ4HC_CLEVEL_MIN で圧縮します。
+ *
+ *      圧縮速度の見積もりがない最初の #update (#reset の直後を含む) は、
+ *      常に本来の圧縮レベルで圧縮して見積もりに用います。
+ *
+ *      一回の #update は一つのブロックとして分割できないため、割り込みは #update から戻る時点で処理されます。
+ *
+ * [ring: false (true or false)]
+ *      真を与えた場合、入力を内部のリングバッファ (320 KiB) へ複写して、そこから圧縮します。
+ *
+ *      LZ4 はリングバッファ上の直前の入力を履歴として直接参照するため、
+ *      #update のたびに最大 64 KiB の履歴を退避する必要がなくなります。
+ *      小さなデータを数多く圧縮する場合に有効です。
+ *
+ *      128 KiB を超える入力はリングバッファを経由せずに圧縮し、従来通り履歴を退避します。
+ *
+ *      出力されるブロックは ring の有無にかかわらず LZ4::BlockDecoder で伸張できます。
+ *
+ * [size_prefix: false (true or false)]
+ *      真を与えた場合、#update が出力するブロックの先頭に伸張後の長さを可変長整数 (符号なし LEB128、最大 5 バイト) で置きます。
+ *
+ *      このブロックは size_prefix: true を与えた LZ4::BlockDecoder で伸張します。
+ *      伸張器は長さを走査せずに知ることができるため、max_dest_size を与えなくても出力先を一度で確保できます。
  */
 static VALUE
 blkenc_init(int argc, VALUE argv[], VALUE enc)
@@ -472,6 +703,23 @@ blkenc_init(int argc, VALUE argv[], VALUE enc)
                 rb_obj_classname(enc), (void *)enc);
     }
 
+    VALUE level, predict, opts, deadline, ring, sizeprefix;
+    argc = rb_scan_args(argc, argv, "02:", &level, &predict, &opts);
+    RBX_SCANHASH(opts, Qnil,
+            RBX_SCANHASH_ARGS("deadline", &deadline, Qnil),
+            RBX_SCANHASH_ARGS("ring", &ring, Qfalse),
+            RBX_SCANHASH_ARGS("size_prefix", &sizeprefix, Qfalse));
+    p->sizeprefix = RTEST(sizeprefix);
+    p->deadline = NIL_P(deadline) ? 0 : NUM2DBL(deadline);
+    if (!NIL_P(deadline) && !(p->deadline > 0)) {
+        rb_raise(rb_eArgError, "deadline: must be positive");
+    }
+
+    if (RTEST(ring) && !p->ring) {
+        p->ring = ALLOC_N(char, AUX_RING_SIZE);
+    }
+
+    /* rb_scan_args の戻り値はキーワード引数を除いた引数の数 */
     blkenc_setup(argc, argv, p, Qnil);
 
     return enc;
@@ -488,18 +736,58 @@ blkenc_update(int argc, VALUE argv[], VALUE enc)
     struct blockencoder *p = encoder_context(enc);
     VALUE src, dest;
     size_t maxsize;
-    blockprocess_args(argc, argv, &src, &dest, &maxsize, NULL, aux_lz4_compressbound);
+    blockprocess_args(argc, argv, &src, &dest, &maxsize, NULL,
+            (p->sizeprefix ? aux_lz4_compressbound_prefixed : aux_lz4_compressbound));
     char *srcp;
     size_t srcsize;
     RSTRING_GETMEM(src, srcp, srcsize);
-    int s = p->traits->update(p->context, srcp, RSTRING_PTR(dest), aux_size2int(srcsize), aux_size2int(maxsize), p->level);
+    size_t off = p->sizeprefix ? aux_lz4_put_prefix(dest, maxsize, aux_size2int(srcsize)) : 0;
+
+    /*
+     * リングバッファへ複写した入力は LZ4 が履歴として直接参照し続けるため、履歴を退避しなくてよい。
+     * 先頭へ戻る場合も、AUX_RING_SIZE の取り方から直前の 64 KiB は上書きされない。
+     */
+    int ring = (p->ring && srcsize <= AUX_RING_INPUT_MAX);
+    if (ring) {
+        if (p->ringoff + srcsize > AUX_RING_SIZE) {
+            p->ringoff = 0;
+        }
+        memcpy(p->ring + p->ringoff, srcp, srcsize);
+        srcp = p->ring + p->ringoff;
+    }
+
+    /*
+     * 期限に間に合わないと見込まれる場合は、この呼び出しに限り圧縮レベルを下げる。
+     * LZ4 は 1 未満の高効率圧縮レベルを LZ4HC_CLEVEL_DEFAULT として扱うため、比較もそれに合わせる。
+     * 割り込みで戻った場合に下げたままにならないよう、圧縮レベルは呼び出しごとに与える。
+     */
+    int level = (p->level < 1) ? LZ4HC_CLEVEL_DEFAULT : p->level;
+    int fallback = (p->deadline > 0 && p->traits == &blockencoder_traits_hc &&
+                    level > LZ4HC_CLEVEL_MIN && p->comprate * srcsize > p->deadline);
+    double t = aux_clock_now();
+    int s = p->traits->update(p->context, srcp, RSTRING_PTR(dest) + off, aux_size2int(srcsize), aux_size2int(maxsize - off),
+                              fallback ? LZ4HC_CLEVEL_MIN : p->level);
+    t = aux_clock_now() - t;
+    if (!fallback && p->deadline > 0 && srcsize > 0) {
+        double rate = t / srcsize;
+        p->comprate = (p->comprate > 0) ? (p->comprate * 3 + rate) / 4 : rate;
+    }
     if (s <= 0) {
         rb_raise(extlz4_eError,
                 "destsize too small (given destsize is %"PRIuSIZE")",
                 rb_str_capacity(dest));
     }
-    p->prefixsize = p->traits->savedict(p->context, p->prefix, sizeof(p->prefix));
-    rb_str_set_len(dest, s);
+    if (ring) {
+        p->ringoff += srcsize;
+    } else {
+        p->prefixsize = p->traits->savedict(p->context, p->prefix, sizeof(p->prefix));
+        p->ringoff = 0;
+    }
+    rb_str_set_len(dest, off + s);
+
+    /* 圧縮の間に保留された割り込みを、辞書を退避して状態が整ってから処理する */
+    rb_thread_check_ints();
+
     return dest;
 }
 
@@ -528,6 +816,8 @@ blkenc_release(VALUE enc)
     }
     p->context = NULL;
     p->traits = NULL;
+    xfree(p->ring);
+    p->ring = NULL;
     memset(p->prefix, 0, sizeof(p->prefix));
     p->prefixsize = 0;
     return Qnil;
@@ -550,6 +840,12 @@ blkenc_savedict(int argc, VALUE argv[], VALUE enc)
     struct blockencoder *p = encoder_context(enc);
     VALUE dict;
 
+    if (p->ring) {
+        /* 履歴はリングバッファにあるので、ここで退避する。以降の履歴は p->prefix を参照する */
+        p->prefixsize = p->traits->savedict(p->context, p->prefix, sizeof(p->prefix));
+        p->ringoff = 0;
+    }
+
     if (argc == 0) {
         dict = rb_str_buf_new(p->prefixsize);
     } else if (argc == 1) {
@@ -603,7 +899,92 @@ blkenc_s_compressbound(VALUE mod, VALUE src)
     return SIZET2NUM(LZ4_compressBound(NUM2UINT(src)));
 }
 
-typedef int aux_lz4_encoder_f(const char *src, char *dest, int srcsize, int maxsize, int level);
+/*
+ * LZ4::BlockEncoder.encode のためにスレッドごとに保持される圧縮状態。
+ *
+ * 一度だけ初期化して、LZ4_compress_*_extState*_fastReset() に与えて使い回す。
+ *
+ * スレッド変数に置くため、同じスレッドのファイバーは一つの状態を共有する。
+ */
+
+static ID id_state_pool;
+
+struct state_pool
+{
+    void *fast;     /* LZ4_stream_t */
+    void *hc;       /* LZ4_streamHC_t */
+};
+
+static void
+state_pool_free(void *pp)
+{
+    struct state_pool *p = pp;
+    xfree(p->fast);
+    xfree(p->hc);
+    xfree(p);
+}
+
+static const rb_data_type_t state_pool_type = {
+    .wrap_struct_name = "extlz4.LZ4.BlockEncoder.state_pool",
+    .function.dmark = NULL,
+    .function.dfree = state_pool_free,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+aux_state_pool(void)
+{
+    VALUE pool = aux_thread_pool_get(id_state_pool, &state_pool_type);
+
+    if (NIL_P(pool)) {
+        struct state_pool *p;
+        pool = TypedData_Make_Struct(rb_cObject, struct state_pool, &state_pool_type, p);
+        aux_thread_pool_set(id_state_pool, pool);
+    }
+
+    return pool;
+}
+
+/*
+ * 高速圧縮であれば LZ4_stream_t、高効率圧縮であれば LZ4_streamHC_t を初期化済みの状態で返す。
+ */
+static void *
+aux_state_pool_get(VALUE pool, int hc)
+{
+    struct state_pool *p = getref(pool, &state_pool_type);
+
+    if (hc) {
+        if (!p->hc) {
+            void *st = xmalloc(LZ4_sizeofStateHC());
+            LZ4_initStreamHC(st, LZ4_sizeofStateHC());
+            p->hc = st;
+        }
+        return p->hc;
+    } else {
+        if (!p->fast) {
+            void *st = xmalloc(LZ4_sizeofState());
+            LZ4_initStream(st, LZ4_sizeofState());
+            p->fast = st;
+        }
+        return p->fast;
+    }
+}
+
+typedef int aux_lz4_encoder_f(void *state, const char *src, char *dest, int srcsize, int maxsize, int level);
+
+static void *
+aux_lz4_encoder_nogvl(va_list *vp)
+{
+    aux_lz4_encoder_f *encoder = va_arg(*vp, aux_lz4_encoder_f *);
+    void *state = va_arg(*vp, void *);
+    const char *src = va_arg(*vp, const char *);
+    char *dest = va_arg(*vp, char *);
+    int srcsize = va_arg(*vp, int);
+    int maxsize = va_arg(*vp, int);
+    int level = va_arg(*vp, int);
+
+    return (void *)(intptr_t)encoder(state, src, dest, srcsize, maxsize, level);
+}
 
 /*
  * call-seq:
@@ -611,6 +992,7 @@ typedef int aux_lz4_encoder_f(const char *src, char *dest, int srcsize, int maxs
  *  encode(src, max_dest_size, dest = "") -> dest with compressed string data
  *  encode(level, src, dest = "") -> dest with compressed string data
  *  encode(level, src, max_dest_size, dest = "") -> dest with compressed string data
+ *  encode(..., size_prefix: true) -> dest with size prefixed compressed string data
  *
  * Encode to block LZ4 data.
  *
@@ -647,6 +1029,15 @@ typedef int aux_lz4_encoder_f(const char *src, char *dest, int srcsize, int maxs
  *
  *      0 に満たない数値を指定した場合、高速圧縮処理が行われます。
  *      内部でこの値は絶対値に変換されて LZ4_compress_fast() の acceleration 引数として渡されます。
+ *
+ * [size_prefix: false (true or false)]
+ *      真を与えた場合、圧縮データの先頭に伸張後の長さを可変長整数 (符号なし LEB128、最大 5 バイト) で置きます。
+ *      max_dest_size はこの長さを含みます。
+ *
+ *      LZ4::BlockDecoder.decode に size_prefix: true を与えて伸張します。
+ *
+ * 圧縮状態はスレッドごとに保持され、呼び出しの間で再利用されます。
+ * src がある程度の長さ (高速圧縮では 64 KiB、高効率圧縮では 4 KiB) 以上であれば、GVL を手放して圧縮します。
  */
 static VALUE
 blkenc_s_encode(int argc, VALUE argv[], VALUE lz4)
@@ -654,14 +1045,20 @@ blkenc_s_encode(int argc, VALUE argv[], VALUE lz4)
     VALUE src, dest;
     size_t maxsize;
     int level;
-    blockprocess_args(argc, argv, &src, &dest, &maxsize, &level, aux_lz4_compressbound);
+    const int prefixed = aux_scan_size_prefix(&argc, argv);
+    blockprocess_args(argc, argv, &src, &dest, &maxsize, &level,
+            (prefixed ? aux_lz4_compressbound_prefixed : aux_lz4_compressbound));
 
     aux_lz4_encoder_f *encoder;
-    if (level < 0) {
-        encoder = LZ4_compress_fast;
+    size_t nogvlsize;
+    const int hc = (level >= 0);
+    if (!hc) {
+        encoder = (aux_lz4_encoder_f *)LZ4_compress_fast_extState_fastReset;
+        nogvlsize = AUX_ONESHOT_NOGVL_SIZE;
         level = -level;
     } else {
-        encoder = LZ4_compress_HC;
+        encoder = (aux_lz4_encoder_f *)LZ4_compress_HC_extStateHC_fastReset;
+        nogvlsize = AUX_ONESHOT_NOGVL_SIZE_HC;
     }
 
     size_t srcsize = RSTRING_LEN(src);
@@ -673,13 +1070,207 @@ blkenc_s_encode(int argc, VALUE argv[], VALUE lz4)
     aux_str_reserve(dest, maxsize);
     rb_str_set_len(dest, 0);
 
-    int size = encoder(RSTRING_PTR(src), RSTRING_PTR(dest), aux_size2int(srcsize), aux_size2int(maxsize), level);
+    size_t off = prefixed ? aux_lz4_put_prefix(dest, maxsize, srcsize) : 0;
+
+    VALUE pool = aux_state_pool();
+    void *state = aux_state_pool_get(pool, hc);
+    int size;
+    if (srcsize >= nogvlsize) {
+        size = (int)(intptr_t)aux_thread_call_without_gvl(aux_lz4_encoder_nogvl, NULL,
+                encoder, state, RSTRING_PTR(src), RSTRING_PTR(dest) + off,
+                aux_size2int(srcsize), aux_size2int(maxsize - off), level);
+    } else {
+        size = encoder(state, RSTRING_PTR(src), RSTRING_PTR(dest) + off, aux_size2int(srcsize), aux_size2int(maxsize - off), level);
+    }
+    RB_GC_GUARD(pool);
+    RB_GC_GUARD(src);
     if (size <= 0) {
         rb_raise(extlz4_eError,
                  "failed LZ4 compress - maxsize is too small, or out of memory");
     }
 
-    rb_str_set_len(dest, size);
+    rb_str_set_len(dest, off + size);
+
+    return dest;
+}
+
+struct blkenc_batch
+{
+    const char **src;
+    int *srcsize;
+    char **dest;
+    int *destsize;
+    int *size;          /* 圧縮後の長さ。失敗した場合は 0 */
+    int level;
+    void **states;      /* ワーカーごとの圧縮状態 */
+};
+
+static void
+blkenc_batch_encode_one(void *arg, size_t index, int worker)
+{
+    struct blkenc_batch *b = arg;
+
+    if (b->level < 0) {
+        b->size[index] = LZ4_compress_fast_extState(b->states[worker],
+                b->src[index], b->dest[index], b->srcsize[index], b->destsize[index], -b->level);
+    } else {
+        b->size[index] = LZ4_compress_HC_extStateHC(b->states[worker],
+                b->src[index], b->dest[index], b->srcsize[index], b->destsize[index], b->level);
+    }
+}
+
+static void *
+blkenc_batch_encode_nogvl(va_list *vp)
+{
+    struct blkenc_batch *b = va_arg(*vp, struct blkenc_batch *);
+    size_t n = va_arg(*vp, size_t);
+    int threads = va_arg(*vp, int);
+
+    extlz4_parallel_run(threads, n, blkenc_batch_encode_one, b);
+
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *  encode_batch(srcs, level = nil, threads: nil, packed: false) -> array of compressed strings
+ *  encode_batch(srcs, level = nil, threads: nil, packed: true) -> [packed compressed string, offsets]
+ *
+ * 文字列の配列 srcs のそれぞれを個別の LZ4 ブロックとして圧縮します。
+ *
+ * 全ての要素は GVL を手放した一度の呼び出しの中で圧縮されるため、
+ * 小さな文字列を数多く圧縮する場合に LZ4::BlockEncoder.encode を繰り返すよりも呼び出しの負担が少なくなります。
+ *
+ * [srcs]
+ *      圧縮する文字列の配列です。圧縮が終わるまで各要素を変更してはなりません。
+ *
+ * [level]
+ *      LZ4::BlockEncoder.encode と同じです。
+ *
+ * [threads: nil (Integer)]
+ *      圧縮処理を並列に行うスレッド数を指定します。nil または 1 以下であれば並列化しません。
+ *
+ * [packed: false (true or false)]
+ *      真を与えた場合、全ての圧縮データを連結した一つの文字列と、
+ *      各要素の開始位置と末尾を表す srcs.size + 1 個の整数の配列を返します。
+ *      i 番目の圧縮データは packed.byteslice(offsets[i] ... offsets[i + 1]) です。
+ */
+static VALUE
+blkenc_s_encode_batch(int argc, VALUE argv[], VALUE lz4)
+{
+    VALUE srcs, level, opts, threads, packed;
+    rb_scan_args(argc, argv, "11:", &srcs, &level, &opts);
+    RBX_SCANHASH(opts, Qnil,
+            RBX_SCANHASH_ARGS("threads", &threads, Qnil),
+            RBX_SCANHASH_ARGS("packed", &packed, Qfalse));
+    rb_check_type(srcs, RUBY_T_ARRAY);
+    srcs = rb_ary_dup(srcs); /* 圧縮中に配列が変更されても影響を受けないようにする */
+
+    struct blkenc_batch b;
+    b.level = NIL_P(level) ? -1 : NUM2INT(level);
+    int nthreads = aux_threads(threads);
+    const size_t n = RARRAY_LEN(srcs);
+    size_t i, total = 0;
+
+    if (nthreads > 1 && (size_t)nthreads > n) {
+        nthreads = (n > 0) ? (int)n : 1;
+    }
+
+    /*
+     * 作業領域と圧縮状態は、例外で脱出しても解放されるように一時バッファにまとめる。
+     *
+     * 一時バッファは GC から保守的にマークされるため、先頭に置いた入出力の文字列は
+     * 回収も移動もされない。文字列のポインタは全ての確保を終えてから取り出す。
+     */
+    const size_t align = 16;
+    size_t statesize = (b.level < 0) ? LZ4_sizeofState() : LZ4_sizeofStateHC();
+    statesize = (statesize + align - 1) & ~(align - 1);
+    size_t worksize = (sizeof(VALUE) * 2 + sizeof(char *) * 2 + sizeof(int) * 3) * n + sizeof(void *) * nthreads;
+    worksize = (worksize + align - 1) & ~(align - 1);
+    VALUE tmp = Qnil;
+    char *work = rb_alloc_tmp_buffer(&tmp, align + worksize + statesize * nthreads);
+    char *states = (char *)(((uintptr_t)work + worksize + align - 1) & ~(uintptr_t)(align - 1));
+    VALUE *srcv = (VALUE *)work;
+    VALUE *destv = srcv + n;
+    MEMZERO(srcv, VALUE, n * 2);
+    b.src = (const char **)(destv + n);
+    b.dest = (char **)(b.src + n);
+    b.states = (void **)(b.dest + n);
+    b.srcsize = (int *)(b.states + nthreads);
+    b.destsize = b.srcsize + n;
+    b.size = b.destsize + n;
+    for (i = 0; i < (size_t)nthreads; i ++) {
+        b.states[i] = states + statesize * i;
+    }
+
+    for (i = 0; i < n; i ++) {
+        VALUE src = srcv[i] = aux_shouldbe_string(RARRAY_AREF(srcs, i));
+        size_t srcsize = RSTRING_LEN(src);
+        if (srcsize > LZ4_MAX_INPUT_SIZE) {
+            rb_raise(extlz4_eError,
+                     "source size is too big for lz4 encode (given %"PRIuSIZE", but max %"PRIuSIZE" bytes)",
+                     srcsize, (size_t)LZ4_MAX_INPUT_SIZE);
+        }
+        b.srcsize[i] = (int)srcsize;
+        b.destsize[i] = LZ4_compressBound((int)srcsize);
+        total += b.destsize[i];
+    }
+
+    VALUE dest = Qnil;
+    if (RTEST(packed)) {
+        dest = rb_str_buf_new(total);
+    } else {
+        dest = rb_ary_new_capa(n);
+        for (i = 0; i < n; i ++) {
+            rb_ary_push(dest, destv[i] = rb_str_buf_new(b.destsize[i]));
+        }
+    }
+
+    char *p = RTEST(packed) ? RSTRING_PTR(dest) : NULL;
+    for (i = 0; i < n; i ++) {
+        b.src[i] = RSTRING_PTR(srcv[i]);
+        if (p) {
+            b.dest[i] = p;
+            p += b.destsize[i];
+        } else {
+            b.dest[i] = RSTRING_PTR(destv[i]);
+        }
+    }
+
+    aux_thread_call_without_gvl(blkenc_batch_encode_nogvl, NULL, &b, n, nthreads);
+
+    for (i = 0; i < n; i ++) {
+        if (b.size[i] <= 0) {
+            rb_raise(extlz4_eError,
+                     "failed LZ4 compress - out of memory (index %"PRIuSIZE")", i);
+        }
+    }
+
+    if (RTEST(packed)) {
+        /* 最悪値の間隔で並べた圧縮データを詰める */
+        VALUE offsets = rb_ary_new_capa(n + 1);
+        char *head = RSTRING_PTR(dest);
+        size_t off = 0, from = 0;
+        rb_ary_push(offsets, INT2FIX(0));
+        for (i = 0; i < n; i ++) {
+            memmove(head + off, head + from, b.size[i]);
+            off += b.size[i];
+            from += b.destsize[i];
+            rb_ary_push(offsets, SIZET2NUM(off));
+        }
+        rb_str_set_len(dest, off);
+        dest = rb_assoc_new(dest, offsets);
+    } else {
+        for (i = 0; i < n; i ++) {
+            VALUE d = RARRAY_AREF(dest, i);
+            /* rb_str_resize は埋め込み文字列へ移す際に現在の長さまでしか複写しない */
+            rb_str_set_len(d, b.size[i]);
+            rb_str_resize(d, b.size[i]);
+        }
+    }
+
+    rb_free_tmp_buffer(&tmp);
+    RB_GC_GUARD(srcs);
 
     return dest;
 }
@@ -702,6 +1293,7 @@ init_blockencoder(void)
 
     rb_define_singleton_method(cBlockEncoder, "compressbound", blkenc_s_compressbound, 1);
     rb_define_singleton_method(cBlockEncoder, "encode", blkenc_s_encode, -1);
+    rb_define_singleton_method(cBlockEncoder, "encode_batch", blkenc_s_encode_batch, -1);
     rb_define_alias(rb_singleton_class(cBlockEncoder), "compress", "encode");
 
     rb_define_const(extlz4_mLZ4, "LZ4HC_CLEVEL_MIN", INT2FIX(LZ4HC_CLEVEL_MIN));
@@ -723,6 +1315,11 @@ struct blockdecoder
 {
     void *context;
     VALUE predict;
+    char *ring;         /* ring: true の場合の出力の履歴 (AUX_RING_SIZE バイト) */
+    size_t ringoff;     /* 次に伸張する ring の位置 */
+    size_t ringwrap;    /* 先頭へ戻る前に伸張した領域の終端。0 であれば dictbuf から続いている */
+    int ringsync;       /* 真であれば履歴は ring ではなく dictbuf にある */
+    int sizeprefix;     /* 真であれば入力の先頭に伸張後の長さが置かれている */
     size_t dictsize;
     char dictbuf[64 * 1024];
 };
@@ -741,6 +1338,7 @@ blkdec_free(void *pp)
     if (p->context) {
         LZ4_freeStreamDecode(p->context);
     }
+    xfree(p->ring);
     memset(p, 0, sizeof(*p));
     xfree(p);
 }
@@ -814,18 +1412,51 @@ blkdec_setup(int argc, VALUE argv[], VALUE predict, struct blockdecoder *p)
     } else {
         p->dictsize = 0;
     }
+
+    p->ringoff = 0;
+    p->ringwrap = 0;
+    p->ringsync = 1;
 }
 
 /*
  * call-seq:
- *  initialize
- *  initialize(preset_dictionary)
+ *  initialize(ring: false, size_prefix: false)
+ *  initialize(preset_dictionary, ring: false, size_prefix: false)
+ *
+ * [ring: false (true or false)]
+ *      真を与えた場合、内部のリングバッファ (320 KiB) へ伸張してから出力先へ複写します。
+ *
+ *      LZ4 はリングバッファ上の直前の出力を履歴として直接参照するため、
+ *      #update のたびに 64 KiB の履歴を詰め直す必要がなくなります。
+ *      小さなデータを数多く伸張する場合に有効です。
+ *
+ *      伸張後の長さが 128 KiB を超える場合はリングバッファを経由せずに伸張します。
+ *
+ *      伸張後の長さは、#update に与えた max_dest_size が 128 KiB 以下であればそれを用い、
+ *      size_prefix: true であれば先頭の長さを用います。
+ *      どちらでもなければ圧縮データを走査して求めます。
+ *
+ * [size_prefix: false (true or false)]
+ *      真を与えた場合、size_prefix: true を与えた LZ4::BlockEncoder が出力したブロックを伸張します。
+ *
+ *      先頭の長さから出力先を確保するため、max_dest_size を与えなくても圧縮データを走査しません。
+ *      max_dest_size を与えた場合、長さがそれを超えていれば例外が発生します。
  */
 static VALUE
 blkdec_init(int argc, VALUE argv[], VALUE dec)
 {
     struct blockdecoder *p = getdecoder(dec);
 
+    VALUE predict, opts, ring, sizeprefix;
+    argc = rb_scan_args(argc, argv, "01:", &predict, &opts);
+    RBX_SCANHASH(opts, Qnil,
+            RBX_SCANHASH_ARGS("ring", &ring, Qfalse),
+            RBX_SCANHASH_ARGS("size_prefix", &sizeprefix, Qfalse));
+    p->sizeprefix = RTEST(sizeprefix);
+    if (RTEST(ring) && !p->ring) {
+        p->ring = ALLOC_N(char, AUX_RING_SIZE);
+    }
+
     blkdec_setup(argc, argv, Qnil, p);
 
     return dec;
@@ -846,6 +1477,69 @@ blkdec_reset(int argc, VALUE argv[], VALUE dec)
     return dec;
 }
 
+/*
+ * ring 上にある履歴を dictbuf へ退避する。
+ *
+ * ring への伸張は常に先頭から始まるため、現在の領域は ring[0, ringoff) である。
+ * 履歴がそれより長ければ、残りは先頭へ戻る前の領域 ring[..., ringwrap) の末尾か、
+ * まだ戻っていなければ dictbuf の末尾にある。
+ */
+static void
+blkdec_ring_save(struct blockdecoder *p)
+{
+    if (p->ringsync) {
+        return;
+    }
+
+    size_t cur = (p->ringoff < sizeof(p->dictbuf)) ? p->ringoff : sizeof(p->dictbuf);
+    size_t size = sizeof(p->dictbuf) - cur;
+    if (p->ringwrap > 0) {
+        /* AUX_RING_SIZE の取り方から、ringwrap の直前 64 KiB は現在の領域に上書きされていない */
+        memcpy(p->dictbuf, p->ring + p->ringwrap - size, size);
+    } else {
+        if (size > p->dictsize) {
+            size = p->dictsize;
+        }
+        memmove(p->dictbuf, p->dictbuf + p->dictsize - size, size);
+    }
+    memcpy(p->dictbuf + size, p->ring + p->ringoff - cur, cur);
+    p->dictsize = size + cur;
+    p->ringoff = 0;
+    p->ringwrap = 0;
+    p->ringsync = 1;
+}
+
+/*
+ * ring 上へ伸張してから dest へ複写する。
+ *
+ * LZ4 は ring 上の履歴を直接参照するため、dictbuf を詰め直す必要がない。
+ * 先頭へ戻る場合も、AUX_RING_SIZE の取り方から直前の 64 KiB は上書きされない。
+ */
+static VALUE
+blkdec_update_ring(struct blockdecoder *p, const char *srcp, size_t srcsize, VALUE dest, size_t maxsize)
+{
+    if (p->ringsync) {
+        LZ4_setStreamDecode(p->context, p->dictbuf, aux_size2int(p->dictsize));
+        p->ringsync = 0;
+    }
+    if (p->ringoff + maxsize > AUX_RING_SIZE) {
+        p->ringwrap = p->ringoff;
+        p->ringoff = 0;
+    }
+
+    char *out = p->ring + p->ringoff;
+    int s = aux_LZ4_decompress_safe_continue(p->context, srcp, out, aux_size2int(srcsize), aux_size2int(maxsize));
+    if (s < 0) {
+        rb_raise(extlz4_eError,
+                "`max_dest_size' too small, or corrupt lz4'd data");
+    }
+    p->ringoff += s;
+    memcpy(RSTRING_PTR(dest), out, s);
+    rb_str_set_len(dest, s);
+
+    return dest;
+}
+
 /*
  * call-seq:
  *  update(src, dest = "") -> dest for decoded string data
@@ -866,10 +1560,28 @@ blkdec_update(int argc, VALUE argv[], VALUE dec)
     if (!p->context) { rb_raise(extlz4_eError, "need reset (context not initialized)"); }
     VALUE src, dest;
     size_t maxsize;
-    blockprocess_args(argc, argv, &src, &dest, &maxsize, NULL, aux_lz4_scansize);
+    blockprocess_args(argc, argv, &src, &dest, &maxsize, NULL,
+            (p->sizeprefix ? aux_lz4_prefixsize : aux_lz4_scansize));
     const char *srcp;
     size_t srcsize;
     RSTRING_GETMEM(src, srcp, srcsize);
+    size_t expected = p->sizeprefix ? aux_lz4_getprefix(&srcp, &srcsize, &maxsize) : SIZE_MAX;
+
+    if (p->ring) {
+        /* max_dest_size が大きくても、実際の長さが収まればリングバッファを経由する */
+        size_t ringsize = maxsize;
+        if (ringsize > AUX_RING_INPUT_MAX && expected == SIZE_MAX) {
+            ringsize = aux_lz4_scanseq_nogvl(srcp, srcp + srcsize, NULL);
+        }
+        if (ringsize <= AUX_RING_INPUT_MAX) {
+            blkdec_update_ring(p, srcp, srcsize, dest, ringsize);
+            rb_thread_check_ints();
+            aux_lz4_checkprefix(dest, expected);
+            return dest;
+        }
+        blkdec_ring_save(p);
+    }
+
     LZ4_setStreamDecode(p->context, p->dictbuf, aux_size2int(p->dictsize));
     int s = aux_LZ4_decompress_safe_continue(p->context, srcp, RSTRING_PTR(dest), aux_size2int(srcsize), aux_size2int(maxsize));
     if (s < 0) {
@@ -877,6 +1589,7 @@ blkdec_update(int argc, VALUE argv[], VALUE dec)
                 "`max_dest_size' too small, or corrupt lz4'd data");
     }
     rb_str_set_len(dest, s);
+    aux_lz4_checkprefix(dest, expected);
 
     /* copy prefix */
     if ((size_t)s < sizeof(p->dictbuf)) {
@@ -894,6 +1607,9 @@ blkdec_update(int argc, VALUE argv[], VALUE dec)
         p->dictsize = sizeof(p->dictbuf);
     }
 
+    /* 伸張の間に保留された割り込みを、履歴を更新してから処理する */
+    rb_thread_check_ints();
+
     return dest;
 }
 
@@ -912,6 +1628,8 @@ blkdec_release(VALUE lz4)
         LZ4_freeStreamDecode(p->context);
         p->context = NULL;
     }
+    xfree(p->ring);
+    p->ring = NULL;
     // TODO: p->predict と p->prefix も rb_str_resize で 0 にするべきか?
     p->predict = Qnil;
     return Qnil;
@@ -951,29 +1669,230 @@ blkdec_s_linksize(VALUE mod, VALUE str)
  * call-seq:
  *  decode(src, dest = "") -> dest with decoded string data
  *  decode(src, max_dest_size, dest = "") -> dest with decoded string data
+ *  decode(..., size_prefix: true) -> dest with decoded string data
  *
  * Decode block LZ4 data.
  *
  * 出力先は、max_dest_size が与えられていない場合、必要に応じて自動的に拡張されます。
  * この場合、いったん圧縮された LZ4 データを走査するため、事前に僅かな CPU 時間を必要とします。
+ *
+ * size_prefix: true を与えた場合、LZ4::BlockEncoder.encode に size_prefix: true を与えて圧縮したデータを伸張します。
+ * 先頭の長さから出力先を一度で確保するため、圧縮データを走査しません。
  */
 static VALUE
 blkdec_s_decode(int argc, VALUE argv[], VALUE lz4)
 {
     VALUE src, dest;
     size_t maxsize;
-    blockprocess_args(argc, argv, &src, &dest, &maxsize, NULL, aux_lz4_scansize);
+    const int prefixed = aux_scan_size_prefix(&argc, argv);
+    blockprocess_args(argc, argv, &src, &dest, &maxsize, NULL,
+            (prefixed ? aux_lz4_prefixsize : aux_lz4_scansize));
+    const char *srcp;
+    size_t srcsize;
+    RSTRING_GETMEM(src, srcp, srcsize);
+    size_t expected = prefixed ? aux_lz4_getprefix(&srcp, &srcsize, &maxsize) : SIZE_MAX;
 
     aux_str_reserve(dest, maxsize);
     rb_str_set_len(dest, 0);
 
-    int size = LZ4_decompress_safe(RSTRING_PTR(src), RSTRING_PTR(dest), rb_long2int(RSTRING_LEN(src)), aux_size2int(maxsize));
+    int size = LZ4_decompress_safe(srcp, RSTRING_PTR(dest), rb_long2int(srcsize), aux_size2int(maxsize));
     if (size < 0) {
         rb_raise(extlz4_eError,
                  "failed LZ4_decompress_safe - max_dest_size is too small, or data is corrupted");
     }
 
     rb_str_set_len(dest, size);
+    aux_lz4_checkprefix(dest, expected);
+
+    return dest;
+}
+
+struct blkdec_batch
+{
+    const char **src;
+    int *srcsize;
+    char **dest;
+    size_t *destsize;   /* 伸張後の最大長。走査する場合は SIZE_MAX が不正なシーケンスを表す */
+    int *size;          /* 伸張後の長さ。失敗した場合は負の値 */
+    int scan;           /* 真であれば destsize を求める段階 */
+};
+
+static void
+blkdec_batch_one(void *arg, size_t index, int worker)
+{
+    struct blkdec_batch *b = arg;
+    (void)worker;
+
+    if (b->scan) {
+        b->destsize[index] = aux_lz4_scanseq_nogvl(b->src[index], b->src[index] + b->srcsize[index], NULL);
+    } else {
+        b->size[index] = LZ4_decompress_safe(b->src[index], b->dest[index], b->srcsize[index], (int)b->destsize[index]);
+    }
+}
+
+static void *
+blkdec_batch_nogvl(va_list *vp)
+{
+    struct blkdec_batch *b = va_arg(*vp, struct blkdec_batch *);
+    size_t n = va_arg(*vp, size_t);
+    int threads = va_arg(*vp, int);
+
+    extlz4_parallel_run(threads, n, blkdec_batch_one, b);
+
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *  decode_batch(blocks, sizes = nil, threads: nil, packed: false) -> array of decoded strings
+ *  decode_batch(blocks, sizes = nil, threads: nil, packed: true) -> [packed decoded string, offsets]
+ *
+ * LZ4 ブロックの配列 blocks のそれぞれを個別に伸張します。
+ *
+ * 伸張後の長さを求めるための走査と伸張処理は、GVL を手放した状態でまとめて行われます。
+ *
+ * [blocks]
+ *      LZ4 ブロックの文字列の配列です。伸張が終わるまで各要素を変更してはなりません。
+ *
+ * [sizes]
+ *      伸張後の最大長を指定します。全てに共通する整数か、blocks と同じ長さの整数の配列を与えます。
+ *
+ *      nil の場合は LZ4::BlockDecoder.scansize と同様に各ブロックを走査して求めます。
+ *
+ * [threads: nil (Integer)]
+ *      走査と伸張を並列に行うスレッド数を指定します。nil または 1 以下であれば並列化しません。
+ *
+ * [packed: false (true or false)]
+ *      真を与えた場合、全ての伸張データを連結した一つの文字列と、
+ *      各要素の開始位置と末尾を表す blocks.size + 1 個の整数の配列を返します。
+ */
+static VALUE
+blkdec_s_decode_batch(int argc, VALUE argv[], VALUE lz4)
+{
+    VALUE blocks, sizes, opts, threads, packed;
+    rb_scan_args(argc, argv, "11:", &blocks, &sizes, &opts);
+    RBX_SCANHASH(opts, Qnil,
+            RBX_SCANHASH_ARGS("threads", &threads, Qnil),
+            RBX_SCANHASH_ARGS("packed", &packed, Qfalse));
+    rb_check_type(blocks, RUBY_T_ARRAY);
+    blocks = rb_ary_dup(blocks); /* 伸張中に配列が変更されても影響を受けないようにする */
+
+    const size_t n = RARRAY_LEN(blocks);
+    int nthreads = aux_threads(threads);
+    size_t i;
+
+    if (!NIL_P(sizes) && !RB_TYPE_P(sizes, RUBY_T_ARRAY)) {
+        sizes = rb_ary_new_from_args(1, sizes);
+    } else if (!NIL_P(sizes) && (size_t)RARRAY_LEN(sizes) != n) {
+        rb_raise(rb_eArgError,
+                 "wrong sizes length (given %ld, expected %"PRIuSIZE")",
+                 RARRAY_LEN(sizes), n);
+    }
+
+    /*
+     * 一時バッファは GC から保守的にマークされるため、先頭に置いた入出力の文字列は
+     * 回収も移動もされない。文字列のポインタは GVL を手放す直前に取り出す。
+     */
+    struct blkdec_batch b;
+    VALUE tmp = Qnil;
+    char *work = rb_alloc_tmp_buffer(&tmp, (sizeof(VALUE) * 2 + sizeof(char *) * 2 + sizeof(size_t) + sizeof(int) * 2) * (n > 0 ? n : 1));
+    VALUE *srcv = (VALUE *)work;
+    VALUE *destv = srcv + n;
+    MEMZERO(srcv, VALUE, n * 2);
+    b.src = (const char **)(destv + n);
+    b.dest = (char **)(b.src + n);
+    b.destsize = (size_t *)(b.dest + n);
+    b.srcsize = (int *)(b.destsize + n);
+    b.size = b.srcsize + n;
+
+    for (i = 0; i < n; i ++) {
+        VALUE src = srcv[i] = aux_shouldbe_string(RARRAY_AREF(blocks, i));
+        b.srcsize[i] = rb_long2int(RSTRING_LEN(src));
+        if (!NIL_P(sizes)) {
+            VALUE size = RARRAY_AREF(sizes, RARRAY_LEN(sizes) == 1 ? 0 : i);
+            b.destsize[i] = NUM2SIZET(size);
+        }
+    }
+
+    if (NIL_P(sizes)) {
+        b.scan = 1;
+        for (i = 0; i < n; i ++) {
+            b.src[i] = RSTRING_PTR(srcv[i]);
+        }
+        aux_thread_call_without_gvl(blkdec_batch_nogvl, NULL, &b, n, nthreads);
+        for (i = 0; i < n; i ++) {
+            if (b.destsize[i] == SIZE_MAX) {
+                rb_raise(extlz4_eError,
+                         "encounted invalid end of sequence (index %"PRIuSIZE")", i);
+            }
+        }
+    }
+
+    size_t total = 0;
+    for (i = 0; i < n; i ++) {
+        aux_size2int(b.destsize[i]);
+        total += b.destsize[i];
+    }
+
+    VALUE dest;
+    if (RTEST(packed)) {
+        dest = rb_str_buf_new(total);
+    } else {
+        dest = rb_ary_new_capa(n);
+        for (i = 0; i < n; i ++) {
+            rb_ary_push(dest, destv[i] = rb_str_buf_new(b.destsize[i]));
+        }
+    }
+
+    char *p = RTEST(packed) ? RSTRING_PTR(dest) : NULL;
+    for (i = 0; i < n; i ++) {
+        b.src[i] = RSTRING_PTR(srcv[i]);
+        if (p) {
+            b.dest[i] = p;
+            p += b.destsize[i];
+        } else {
+            b.dest[i] = RSTRING_PTR(destv[i]);
+        }
+    }
+
+    b.scan = 0;
+    aux_thread_call_without_gvl(blkdec_batch_nogvl, NULL, &b, n, nthreads);
+
+    for (i = 0; i < n; i ++) {
+        if (b.size[i] < 0) {
+            rb_raise(extlz4_eError,
+                     "failed LZ4_decompress_safe - max_dest_size is too small, or data is corrupted (index %"PRIuSIZE")", i);
+        }
+    }
+
+    if (RTEST(packed)) {
+        /* 最大長の間隔で並べた伸張データを詰める */
+        VALUE offsets = rb_ary_new_capa(n + 1);
+        char *head = RSTRING_PTR(dest);
+        size_t off = 0, from = 0;
+        rb_ary_push(offsets, INT2FIX(0));
+        for (i = 0; i < n; i ++) {
+            if (off != from) {
+                memmove(head + off, head + from, b.size[i]);
+            }
+            off += b.size[i];
+            from += b.destsize[i];
+            rb_ary_push(offsets, SIZET2NUM(off));
+        }
+        rb_str_set_len(dest, off);
+        dest = rb_assoc_new(dest, offsets);
+    } else {
+        for (i = 0; i < n; i ++) {
+            VALUE d = RARRAY_AREF(dest, i);
+            rb_str_set_len(d, b.size[i]);
+            if ((size_t)b.size[i] != b.destsize[i]) {
+                rb_str_resize(d, b.size[i]);
+            }
+        }
+    }
+
+    rb_free_tmp_buffer(&tmp);
+    RB_GC_GUARD(blocks);
 
     return dest;
 }
@@ -995,6 +1914,7 @@ init_blockdecoder(void)
     rb_define_singleton_method(cBlockDecoder, "scansize", blkdec_s_scansize, 1);
     rb_define_singleton_method(cBlockDecoder, "linksize", blkdec_s_linksize, 1);
     rb_define_singleton_method(cBlockDecoder, "decode", blkdec_s_decode, -1);
+    rb_define_singleton_method(cBlockDecoder, "decode_batch", blkdec_s_decode_batch, -1);
     rb_define_alias(rb_singleton_class(cBlockDecoder), "decompress", "decode");
     rb_define_alias(rb_singleton_class(cBlockDecoder), "uncompress", "decode");
 }
@@ -1006,6 +1926,8 @@ init_blockdecoder(void)
 void
 extlz4_init_blockapi(void)
 {
+    id_state_pool = rb_intern("__extlz4_state_pool__");
+
     init_blockencoder();
     init_blockdecoder();
 }
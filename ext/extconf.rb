@@ -40,6 +40,10 @@ using MyExtensions
 
 append_cppflags "-I$(srcdir)/../contrib/lz4/lib"
 
+have_header "sys/mman.h"
+have_header "pthread.h"
+have_func "rb_io_descriptor"
+
 if RbConfig::CONFIG["arch"] =~ /mingw/
   append_ldflags "-static-libgcc"
 else
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/time.h>
 
 #ifndef RB_OBJ_FROZEN
 #   define RB_OBJ_FROZEN    OBJ_FROZEN
@@ -18,6 +20,58 @@ extern VALUE extlz4_eError;    /* class LZ4::Error < ::RuntimeError */
 extern void extlz4_init_blockapi(void);
 extern void extlz4_init_frameapi(void);
 
+typedef void extlz4_parallel_f(void *arg, size_t index, int worker);
+extern void extlz4_parallel_run(int threads, size_t njobs, extlz4_parallel_f *func, void *arg);
+
+enum {
+    AUX_THREADS_MAX = 256,
+};
+
+/*
+ * threads: 引数を extlz4_parallel_run に渡すスレッド数に変換する。
+ */
+static inline int
+aux_threads(VALUE threads)
+{
+    if (NIL_P(threads) || threads == Qfalse) {
+        return 1;
+    } else {
+        int n = NUM2INT(threads);
+        if (n < 1) {
+            return 1;
+        } else if (n > AUX_THREADS_MAX) {
+            return AUX_THREADS_MAX;
+        } else {
+            return n;
+        }
+    }
+}
+
+/*
+ * 現在のスレッドのスレッド変数 key から、type の TypedData オブジェクトを返す。
+ * なければ (あるいは他の値に置き換えられていれば) nil を返す。
+ *
+ * Thread#[] と異なりスレッド変数はファイバー間で共有されるため、
+ * ファイバーを数多く使っても資源はスレッドごとに一つで済む。
+ * 取り出した資源は ruby のコードを挟まずに使い終えること。
+ */
+static inline VALUE
+aux_thread_pool_get(ID key, const rb_data_type_t *type)
+{
+    VALUE pool = rb_funcall(rb_thread_current(), rb_intern("thread_variable_get"), 1, ID2SYM(key));
+    if (RB_TYPE_P(pool, RUBY_T_DATA) && RTYPEDDATA_P(pool) && RTYPEDDATA_TYPE(pool) == type) {
+        return pool;
+    } else {
+        return Qnil;
+    }
+}
+
+static inline void
+aux_thread_pool_set(ID key, VALUE pool)
+{
+    rb_funcall(rb_thread_current(), rb_intern("thread_variable_set"), 2, ID2SYM(key), pool);
+}
+
 #ifndef RB_EXT_RACTOR_SAFE
 # define RB_EXT_RACTOR_SAFE(FEATURE) ((void)(FEATURE))
 #endif
@@ -41,6 +95,97 @@ aux_thread_call_without_gvl(void *(*func)(va_list *), void (*cancel)(va_list *),
     return s;
 }
 
+struct aux_thread_call
+{
+    void *(*func)(va_list *);
+    va_list *va;
+    int done;
+    void *result;
+};
+
+static inline void *
+aux_thread_call_func(void *pp)
+{
+    struct aux_thread_call *c = pp;
+    c->result = c->func(c->va);
+    c->done = 1;
+    return NULL;
+}
+
+/*
+ * aux_thread_call_without_gvl と同じだが、割り込みがあっても func から戻った時点では例外を発生させない。
+ *
+ * 保留されている割り込みは func を呼ぶ前に処理するため、呼び出し元は呼び出す前に状態を整えておくこと。
+ * func の実行中に届いた割り込みは、func の処理結果を反映させた後で呼び出し元が rb_thread_check_ints() で処理するか、
+ * 次の呼び出しで処理される。
+ *
+ * cancel は割り込みの際に GVL を持たない状態で呼ばれる。
+ * func へ中断を伝える以外のことをしてはならない。
+ */
+static inline void *
+aux_thread_call_without_gvl2(void *(*func)(va_list *), void (*cancel)(va_list *), ...)
+{
+    struct aux_thread_call c = { func, NULL, 0, NULL };
+
+    do {
+        /* 割り込みが保留されていると func が呼ばれずに戻るため、先に処理しておく */
+        rb_thread_check_ints();
+
+        va_list va1, va2;
+        va_start(va1, cancel);
+        va_start(va2, cancel);
+        c.va = &va1;
+        rb_thread_call_without_gvl2(aux_thread_call_func, &c, (void (*)(void *))cancel, &va2);
+        va_end(va1);
+        va_end(va2);
+    } while (!c.done);
+
+    return c.result;
+}
+
+/*
+ * GVL を手放して func を一度だけ呼び出し、その戻り値を *result に格納して真を返す。
+ * 割り込みがあっても例外を発生させない。
+ *
+ * 割り込みが保留されていると func を呼ばずに偽を返す。
+ * 呼び出し元は状態を整えてから rb_thread_check_ints() を呼び、改めて呼び出すこと。
+ *
+ * 呼び出す前の状態では割り込みを処理できない (入力を取り込み済みであるなど) 場合に用いる。
+ */
+static inline int
+aux_thread_try_without_gvl(void **result, void *(*func)(va_list *), void (*cancel)(va_list *), ...)
+{
+    struct aux_thread_call c = { func, NULL, 0, NULL };
+
+    va_list va1, va2;
+    va_start(va1, cancel);
+    va_start(va2, cancel);
+    c.va = &va1;
+    rb_thread_call_without_gvl2(aux_thread_call_func, &c, (void (*)(void *))cancel, &va2);
+    va_end(va1);
+    va_end(va2);
+
+    *result = c.result;
+    return c.done;
+}
+
+/*
+ * 経過時間の計測に用いる単調増加時計 (秒)。
+ */
+static inline double
+aux_clock_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
 static inline void
 aux_str_reserve(VALUE str, size_t size)
 {
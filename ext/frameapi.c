@@ -1,10 +1,29 @@
 #include "extlz4.h"
+#include <ruby/io.h>
+#include <math.h>
+#ifdef HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+#include <lz4.h>
 #include <lz4frame.h>
 #include <lz4frame_static.h>
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
 #include "hashargs.h"
 
 static ID id_op_lshift;
 static ID id_read;
+static ID id_write;
+static ID id_binmode_p;
+static ID id_cctx_pool;
+static ID id_seek;
+static ID id_size;
+static ID id_pos;
 
 enum {
     FLAG_LEGACY = 1 << 0,
@@ -20,8 +39,57 @@ enum {
     AUX_LZ4F_FINISH_SIZE = 16, /* from lz4frame.c */
 
     AUX_LZ4F_PARTIAL_READ_SIZE = 256 * 1024, /* 256 KiB */
+
+    AUX_DICTIONARY_MAX = 64 * 1024, /* 64 KiB : LZ4F_createCDict が参照する最大長 */
+
+    AUX_ENTROPY_SLICES = 8,         /* 圧縮性の判定のためにブロックから抜き出す断片の数 */
+    AUX_ENTROPY_SLICE_SIZE = 512,   /* 断片の長さ */
+    AUX_STORED_BLOCK_FLAG = 0x80000000, /* ブロックヘッダの非圧縮フラグ */
 };
 
+#ifdef LZ4F_MAGIC_SKIPPABLE_START
+#   define AUX_LZ4F_MAGIC_SKIPPABLE_START LZ4F_MAGIC_SKIPPABLE_START
+#else
+#   define AUX_LZ4F_MAGIC_SKIPPABLE_START 0x184D2A50U
+#endif
+
+/*
+ * シーク用索引 (index: true) を格納するスキップ可能フレーム。
+ *
+ * 索引はフレームの直後に置かれ、内容は以下の通り (すべてリトルエンディアン)。
+ *
+ *  uint32_t magic;         AUX_SEEK_INDEX_MAGIC
+ *  uint32_t size;          以降の長さ (nblocks * 8 + 16)
+ *  struct {
+ *      uint32_t csize;     ブロックヘッダとブロックチェックサムを含むブロックの長さ
+ *      uint32_t usize;     展開後の長さ
+ *  } blocks[nblocks];
+ *  uint32_t headersize;    フレームヘッダの長さ
+ *  uint32_t trailersize;   終端マークと内容のチェックサムの長さ
+ *  uint32_t nblocks;
+ *  uint32_t signature;     AUX_SEEK_INDEX_SIGNATURE
+ *
+ * 末尾が固定長であるため、入力の終端から遡って索引とフレームを見つけられる。
+ */
+#define AUX_SEEK_INDEX_MAGIC        (AUX_LZ4F_MAGIC_SKIPPABLE_START + 0x0e)
+#define AUX_SEEK_INDEX_SIGNATURE    0x49345a4cU     /* "LZ4I" */
+#define AUX_SEEK_INDEX_FOOTER       16
+
+/* この値 (bits/byte) 以上のエントロピーを持つブロックは圧縮できないものとみなす */
+#define AUX_ENTROPY_THRESHOLD 7.8
+
+/*
+ * adaptive: true の場合に切り替える圧縮レベル。
+ * 負の値は LZ4F の高速化 (acceleration) 指定、3 以上は高効率圧縮となる。
+ */
+static const int aux_adaptive_levels[] = { -32, -16, -8, -4, -2, 1, 3, 4, 6, 9, 12 };
+#define AUX_ADAPTIVE_LEVELS ((int)(sizeof(aux_adaptive_levels) / sizeof(aux_adaptive_levels[0])))
+
+/*
+ * deadline: の期限に間に合わないと見込まれる場合に用いる圧縮レベル。
+ */
+#define AUX_DEADLINE_LEVEL 1
+
 /*** auxiliary and common functions ***/
 
 static inline void
@@ -52,10 +120,94 @@ aux_LZ4F_compressUpdate(LZ4F_compressionContext_t encoder,
         char *dest, size_t destsize, const char *src, size_t srcsize,
         LZ4F_compressOptions_t *opts)
 {
-    return (size_t)aux_thread_call_without_gvl(aux_LZ4F_compressUpdate_nogvl, NULL,
+    return (size_t)aux_thread_call_without_gvl2(aux_LZ4F_compressUpdate_nogvl, NULL,
             encoder, dest, destsize, src, srcsize, opts);
 }
 
+static void *
+aux_LZ4F_compressBegin_nogvl(va_list *p)
+{
+    LZ4F_compressionContext_t encoder = va_arg(*p, LZ4F_compressionContext_t);
+    char *dest = va_arg(*p, char *);
+    size_t destsize = va_arg(*p, size_t);
+    const LZ4F_CDict *cdict = va_arg(*p, const LZ4F_CDict *);
+    const LZ4F_preferences_t *prefs = va_arg(*p, const LZ4F_preferences_t *);
+
+    return (void *)LZ4F_compressBegin_usingCDict(encoder, dest, destsize, cdict, prefs);
+}
+
+static size_t
+aux_LZ4F_compressBegin(LZ4F_compressionContext_t encoder,
+        char *dest, size_t destsize,
+        const LZ4F_CDict *cdict, const LZ4F_preferences_t *prefs)
+{
+    return (size_t)aux_thread_call_without_gvl2(aux_LZ4F_compressBegin_nogvl, NULL,
+            encoder, dest, destsize, cdict, prefs);
+}
+
+static void *
+aux_LZ4F_flush_nogvl(va_list *p)
+{
+    LZ4F_compressionContext_t encoder = va_arg(*p, LZ4F_compressionContext_t);
+    char *dest = va_arg(*p, char *);
+    size_t destsize = va_arg(*p, size_t);
+    int end = va_arg(*p, int);
+
+    if (end) {
+        return (void *)LZ4F_compressEnd(encoder, dest, destsize, NULL);
+    } else {
+        return (void *)LZ4F_flush(encoder, dest, destsize, NULL);
+    }
+}
+
+/*
+ * LZ4F_flush() または LZ4F_compressEnd() を GVL を手放して呼び出す。
+ *
+ * HC の場合、保留中のブロックの圧縮がここで行われる。
+ *
+ * 圧縮側の LZ4F の呼び出しは、結果を出力するまで割り込みを保留する (fenc_output を参照)。
+ */
+static size_t
+aux_LZ4F_flush(LZ4F_compressionContext_t encoder, char *dest, size_t destsize, int end)
+{
+    return (size_t)aux_thread_call_without_gvl2(aux_LZ4F_flush_nogvl, NULL,
+            encoder, dest, destsize, end);
+}
+
+static void *
+aux_LZ4F_decompress_nogvl(va_list *p)
+{
+    LZ4F_decompressionContext_t decoder = va_arg(*p, LZ4F_decompressionContext_t);
+    char *dest = va_arg(*p, char *);
+    size_t *destsize = va_arg(*p, size_t *);
+    const char *src = va_arg(*p, const char *);
+    size_t *srcsize = va_arg(*p, size_t *);
+    const void *dict = va_arg(*p, const void *);
+    size_t dictsize = va_arg(*p, size_t);
+
+    return (void *)LZ4F_decompress_usingDict(decoder, dest, destsize, src, srcsize, dict, dictsize, NULL);
+}
+
+/*
+ * LZ4F_decompress_usingDict() を GVL を手放して呼び出す。
+ *
+ * 戻った時点で LZ4F は入力を消費しているため、割り込みは保留する。
+ * 呼び出し元は status や入力の位置を更新してから rb_thread_check_ints() を呼ぶこと。
+ */
+static size_t
+aux_LZ4F_decompress(LZ4F_decompressionContext_t decoder,
+        char *dest, size_t *destsize, const char *src, size_t *srcsize,
+        const void *dict, size_t dictsize)
+{
+    void *s;
+    while (!aux_thread_try_without_gvl(&s, aux_LZ4F_decompress_nogvl, NULL,
+                decoder, dest, destsize, src, srcsize, dict, dictsize)) {
+        /* 呼ばれなかった場合は入力を消費していない */
+        rb_thread_check_ints();
+    }
+    return (size_t)s;
+}
+
 static int
 aux_frame_level(const LZ4F_preferences_t *p)
 {
@@ -84,596 +236,3427 @@ aux_frame_checksum(const LZ4F_frameInfo_t *info)
     return info->contentChecksumFlag == LZ4F_contentChecksumEnabled;
 }
 
-/*** class LZ4::Encoder ***/
+static inline void
+aux_write_le32(char *p, uint32_t n)
+{
+    p[0] = (char)(n >>  0);
+    p[1] = (char)(n >>  8);
+    p[2] = (char)(n >> 16);
+    p[3] = (char)(n >> 24);
+}
 
-struct encoder
+static inline uint32_t
+aux_read_le32(const char *p)
 {
-    VALUE outport;
-    VALUE workbuf;
-    LZ4F_preferences_t prefs;
-    LZ4F_compressionContext_t encoder;
+    const unsigned char *q = (const unsigned char *)p;
+    return ((uint32_t)q[0] <<  0) | ((uint32_t)q[1] <<  8) |
+           ((uint32_t)q[2] << 16) | ((uint32_t)q[3] << 24);
+}
+
+/*
+ * LZ4::Encoder#stats と LZ4::Decoder#stats のための統計情報。
+ *
+ * ブロック数は、フレームヘッダ以降のデータ列をブロックヘッダに沿って辿ることで数える。
+ */
+struct aux_stats
+{
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t blocks;
+    uint64_t stored_blocks;     /* 非圧縮のまま格納されたブロック数 */
+    uint64_t fallback_blocks;   /* deadline: により圧縮レベルを下げたブロック数 */
+    double codec_time;          /* GVL を手放して圧縮・展開に費やした時間 */
+    double io_time;             /* outport / inport の処理に費やした時間 */
+
+    char header[4];             /* 読み取り途中のブロックヘッダ */
+    int headerlen;
+    int blocksum;               /* 真であればブロックごとにチェックサムが付く */
+    int ended;                  /* エンドマークに到達した */
+    size_t skip;                /* ブロックヘッダの前に読み飛ばすバイト数 */
 };
 
+/*
+ * 新しいフレームの開始時に呼ぶ。最初の skip バイトはフレームヘッダとして読み飛ばされる。
+ */
 static void
-encoder_mark(void *pp)
+aux_stats_begin(struct aux_stats *st, size_t skip, int blocksum)
 {
-    struct encoder *p = pp;
-    rb_gc_mark(p->outport);
-    rb_gc_mark(p->workbuf);
+    st->headerlen = 0;
+    st->blocksum = blocksum;
+    st->ended = 0;
+    st->skip = skip;
 }
 
 static void
-encoder_free(void *pp)
+aux_stats_scan(struct aux_stats *st, const char *p, size_t size)
 {
-    struct encoder *p = pp;
-    if (p->encoder) {
-        LZ4F_freeCompressionContext(p->encoder);
+    while (size > 0 && !st->ended) {
+        if (st->skip > 0) {
+            size_t s = (st->skip < size) ? st->skip : size;
+            st->skip -= s;
+            p += s;
+            size -= s;
+            continue;
+        }
+
+        st->header[st->headerlen ++] = *p ++;
+        size --;
+        if (st->headerlen < 4) {
+            continue;
+        }
+
+        uint32_t h = aux_read_le32(st->header);
+        st->headerlen = 0;
+        if (h == 0) {
+            st->ended = 1; /* end mark */
+        } else {
+            st->blocks ++;
+            if (h & AUX_STORED_BLOCK_FLAG) {
+                st->stored_blocks ++;
+            }
+            st->skip = (h & 0x7fffffff) + (st->blocksum ? 4 : 0);
+        }
     }
-    memset(p, 0, sizeof(*p));
-    xfree(p);
 }
 
-static const rb_data_type_t encoder_type = {
-    .wrap_struct_name = "extlz4.LZ4.Encoder",
-    .function.dmark = encoder_mark,
-    .function.dfree = encoder_free,
-    /* .function.dsize = encoder_size, */
-    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
-};
-
 static VALUE
-fenc_alloc(VALUE mod)
+aux_stats_to_hash(const struct aux_stats *st, const char *codec, const char *io)
 {
-    struct encoder *p;
-    VALUE obj = TypedData_Make_Struct(mod, struct encoder, &encoder_type, p);
-    p->outport = Qnil;
-    p->workbuf = Qnil;
-    return obj;
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(rb_intern("bytes_in")), ULL2NUM(st->bytes_in));
+    rb_hash_aset(h, ID2SYM(rb_intern("bytes_out")), ULL2NUM(st->bytes_out));
+    rb_hash_aset(h, ID2SYM(rb_intern("blocks")), ULL2NUM(st->blocks));
+    rb_hash_aset(h, ID2SYM(rb_intern("stored_blocks")), ULL2NUM(st->stored_blocks));
+    rb_hash_aset(h, ID2SYM(rb_intern(codec)), DBL2NUM(st->codec_time));
+    rb_hash_aset(h, ID2SYM(rb_intern(io)), DBL2NUM(st->io_time));
+    return h;
 }
 
-static inline int
-fenc_init_args_blocksize(size_t size)
+/*
+ * ブロックのいくつかの断片から求めたバイト値のエントロピーが高ければ、圧縮できないとみなして真を返す。
+ *
+ * 圧縮済みの画像や暗号化されたデータを、実際に圧縮を試みることなく判別するために用いる。
+ */
+static int
+aux_incompressible_p(const char *src, size_t size)
 {
-    if (size == 0) {
-        return LZ4F_default;
-    } else if (size <= 64 * 1024) {
-        return LZ4F_max64KB;
-    } else if (size <= 256 * 1024) {
-        return LZ4F_max256KB;
-    } else if (size <= 1 * 1024 * 1024) {
-        return LZ4F_max1MB;
-    } else {
-        return LZ4F_max4MB;
+    uint32_t freq[256] = { 0 };
+    size_t total = 0;
+    int i;
+
+    if (size < AUX_ENTROPY_SLICES * AUX_ENTROPY_SLICE_SIZE) {
+        return 0; /* 小さなブロックは実際に圧縮したほうが確実 */
+    }
+
+    size_t step = (size - AUX_ENTROPY_SLICE_SIZE) / (AUX_ENTROPY_SLICES - 1);
+    for (i = 0; i < AUX_ENTROPY_SLICES; i ++) {
+        const unsigned char *q = (const unsigned char *)src + step * i;
+        const unsigned char *qq = q + AUX_ENTROPY_SLICE_SIZE;
+        for (; q < qq; q ++) {
+            freq[*q] ++;
+        }
+        total += AUX_ENTROPY_SLICE_SIZE;
+    }
+
+    double entropy = 0;
+    for (i = 0; i < 256; i ++) {
+        if (freq[i] > 0) {
+            double p = (double)freq[i] / total;
+            entropy -= p * log2(p);
+        }
     }
+
+    return entropy >= AUX_ENTROPY_THRESHOLD;
 }
 
-static inline void
-fenc_init_args(int argc, VALUE argv[], VALUE *outport, LZ4F_preferences_t *prefs)
+/*
+ * src を非圧縮ブロックとして dest に書き込み、書き込んだバイト数を返す。
+ *
+ * dest は size + 4 バイト以上の領域が必要。
+ */
+static size_t
+aux_frame_stored_block(char *dest, const char *src, size_t size)
 {
-    VALUE level, opts;
-    rb_scan_args(argc, argv, "02:", outport, &level, &opts);
-
-    memset(prefs, 0, sizeof(*prefs));
+    aux_write_le32(dest, (uint32_t)size | AUX_STORED_BLOCK_FLAG);
+    memcpy(dest + 4, src, size);
+    return size + 4;
+}
 
-    if (NIL_P(*outport)) {
-        *outport = rb_str_buf_new(0);
+/*
+ * IO#<< (と、それが呼び出す IO#write) が再定義されていないバイナリモードの IO であれば、
+ * 書き込み用のファイル記述子を直接扱えるものとして真を返す。
+ */
+static int
+aux_io_direct_writable_p(VALUE io)
+{
+    if (!RB_TYPE_P(io, RUBY_T_FILE) ||
+            !rb_method_basic_definition_p(CLASS_OF(io), id_op_lshift) ||
+            !rb_method_basic_definition_p(CLASS_OF(io), id_write)) {
+        return 0;
     }
 
-    prefs->compressionLevel = NIL_P(level) ? 1 : NUM2INT(level);
+    rb_io_t *fptr;
+    GetOpenFile(rb_io_get_write_io(io), fptr);
+    rb_io_check_writable(fptr);
 
-    if (!NIL_P(opts)) {
-        VALUE blocksize, blocklink, checksum;
-        RBX_SCANHASH(opts, Qnil,
-                RBX_SCANHASH_ARGS("blocksize", &blocksize, Qnil),
-                RBX_SCANHASH_ARGS("blocklink", &blocklink, Qfalse),
-                RBX_SCANHASH_ARGS("checksum", &checksum, Qtrue));
-        // prefs->autoFlush = TODO;
-        prefs->frameInfo.blockSizeID = NIL_P(blocksize) ? LZ4F_default : fenc_init_args_blocksize(NUM2INT(blocksize));
-        prefs->frameInfo.blockMode = RTEST(blocklink) ? LZ4F_blockLinked : LZ4F_blockIndependent;
-        prefs->frameInfo.contentChecksumFlag = RTEST(checksum) ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum;
-    } else {
-        prefs->frameInfo.blockSizeID = LZ4F_default;
-        prefs->frameInfo.blockMode = LZ4F_blockIndependent;
-        prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
-    }
+    return RTEST(rb_funcall2(io, id_binmode_p, 0, NULL));
 }
 
-static struct encoder *
-getencoderp(VALUE enc)
+static int
+aux_io_fd(VALUE io)
 {
-    return getrefp(enc, &encoder_type);
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    return rb_io_descriptor(io);
+#else
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    return fptr->fd;
+#endif
 }
 
-static struct encoder *
-getencoder(VALUE enc)
+static void *
+aux_write_nogvl(va_list *vp)
 {
-    return getref(enc, &encoder_type);
+    int fd = va_arg(*vp, int);
+    const char *buf = va_arg(*vp, const char *);
+    size_t size = va_arg(*vp, size_t);
+
+    return (void *)(intptr_t)write(fd, buf, size);
 }
 
 /*
- * call-seq:
- *  initialize(outport = "".b, level = 1, blocksize: nil, blocklink: false, checksum: true)
+ * GVL を手放して write(2) で IO へ直接書き込む。
+ *
+ * IO が持つ書き込みバッファは先に吐き出しておく。
  */
-static VALUE
-fenc_init(int argc, VALUE argv[], VALUE enc)
+static void
+aux_io_write_direct(VALUE io, const char *buf, size_t size)
 {
-    struct encoder *p = getencoder(enc);
-    VALUE outport;
-    fenc_init_args(argc, argv, &outport, &p->prefs);
+    io = rb_io_get_write_io(io);
+    rb_io_flush(io);
+    int fd = aux_io_fd(io);
+
+    while (size > 0) {
+        ssize_t s = (ssize_t)(intptr_t)aux_thread_call_without_gvl(
+                aux_write_nogvl, (void (*)(va_list *))RUBY_UBF_IO, fd, buf, size);
+        if (s < 0) {
+            switch (errno) {
+            case EINTR:
+                rb_thread_check_ints();
+                continue;
+            case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+                rb_thread_fd_writable(fd);
+                continue;
+            default:
+                rb_sys_fail_str(rb_inspect(io));
+            }
+        }
 
-    LZ4F_errorCode_t status;
-    status = LZ4F_createCompressionContext(&p->encoder, LZ4F_VERSION);
-    aux_lz4f_check_error(status);
-    p->workbuf = rb_str_buf_new(AUX_LZ4F_BLOCK_SIZE_MAX);
-    size_t s = LZ4F_compressBegin(p->encoder, RSTRING_PTR(p->workbuf), rb_str_capacity(p->workbuf), &p->prefs);
-    aux_lz4f_check_error(s);
-    rb_str_set_len(p->workbuf, s);
-    rb_funcall2(outport, id_op_lshift, 1, &p->workbuf);
-    p->outport = outport;
-    return enc;
+        buf += s;
+        size -= s;
+    }
 }
 
-static inline void
-fenc_update(struct encoder *p, VALUE src, LZ4F_compressOptions_t *opts)
+/*
+ * IO#read が再定義されていないバイナリモードの IO であれば、
+ * 読み込み用のファイル記述子を直接扱えるものとして真を返す。
+ */
+static int
+aux_io_direct_readable_p(VALUE io)
 {
-    rb_check_type(src, RUBY_T_STRING);
-    const char *srcp = RSTRING_PTR(src);
-    const char *srctail = srcp + RSTRING_LEN(src);
-    while (srcp < srctail) {
-        size_t srcsize = srctail - srcp;
-        if (srcsize > AUX_LZ4F_BLOCK_SIZE_MAX) { srcsize = AUX_LZ4F_BLOCK_SIZE_MAX; }
-        size_t destsize = LZ4F_compressBound(srcsize, &p->prefs);
-        aux_str_reserve(p->workbuf, destsize);
-        char *destp = RSTRING_PTR(p->workbuf);
-        size_t size = aux_LZ4F_compressUpdate(p->encoder, destp, destsize, srcp, srcsize, opts);
-        aux_lz4f_check_error(size);
-        rb_str_set_len(p->workbuf, size);
-        rb_funcall2(p->outport, id_op_lshift, 1, &p->workbuf);
-        srcp += srcsize;
+    if (!RB_TYPE_P(io, RUBY_T_FILE) ||
+            !rb_method_basic_definition_p(CLASS_OF(io), id_read)) {
+        return 0;
     }
+
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    rb_io_check_readable(fptr);
+
+    return RTEST(rb_funcall2(io, id_binmode_p, 0, NULL));
 }
 
 /*
- * call-seq:
- *  write(src) -> self
+ * IO が読み込みバッファにデータを持っていれば真を返す。
  */
-static VALUE
-fenc_write(int argc, VALUE argv[], VALUE enc)
+static int
+aux_io_read_pending_p(VALUE io)
 {
-    struct encoder *p = getencoder(enc);
-    VALUE src;
-    rb_scan_args(argc, argv, "1", &src);
-    fenc_update(p, src, NULL);
-    return enc;
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    return rb_io_read_pending(fptr);
 }
 
-static VALUE
-fenc_push(VALUE enc, VALUE src)
+struct aux_io_read
 {
-    struct encoder *p = getencoder(enc);
-    fenc_update(p, src, NULL);
-    return enc;
+    int fd;
+    char *buf;
+    size_t size;
+    ssize_t result;
+    int err;
+};
+
+static void *
+aux_read_nogvl(void *pp)
+{
+    struct aux_io_read *r = pp;
+    r->result = read(r->fd, r->buf, r->size);
+    r->err = errno;
+    return NULL;
 }
 
-static VALUE
-fenc_flush(VALUE enc)
+/*
+ * GVL を手放して read(2) で IO から直接読み込む。
+ *
+ * 読み込んだバイト数を返す。0 であれば EOF。
+ *
+ * 読み込めた場合は、割り込みが保留されていても例外を発生させずに返す
+ * (呼び出し元が読み込んだデータを取り込んだ後で処理する)。
+ * 割り込みを処理するのは、何も読み込んでいない時だけである。
+ */
+static size_t
+aux_io_read_direct(VALUE io, char *buf, size_t size)
 {
-    struct encoder *p = getencoder(enc);
-    size_t destsize = AUX_LZ4F_BLOCK_SIZE_MAX + AUX_LZ4F_FINISH_SIZE;
-    aux_str_reserve(p->workbuf, destsize);
-    char *destp = RSTRING_PTR(p->workbuf);
-    size_t size = LZ4F_flush(p->encoder, destp, destsize, NULL);
-    aux_lz4f_check_error(size);
-    rb_str_set_len(p->workbuf, size);
-    rb_funcall2(p->outport, id_op_lshift, 1, &p->workbuf);
+    int fd = aux_io_fd(io);
+
+    for (;;) {
+        /* 割り込みが保留されていると aux_read_nogvl は呼ばれずに戻る */
+        struct aux_io_read r = { fd, buf, size, -1, EINTR };
+        rb_thread_call_without_gvl2(aux_read_nogvl, &r, RUBY_UBF_IO, NULL);
+        if (r.result >= 0) {
+            return r.result;
+        }
 
-    return enc;
+        switch (r.err) {
+        case EINTR:
+            rb_thread_check_ints();
+            continue;
+        case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            rb_thread_wait_fd(fd);
+            continue;
+        default:
+            errno = r.err;
+            rb_sys_fail_str(rb_inspect(io));
+        }
+    }
 }
 
-static VALUE
-fenc_close(VALUE enc)
+/*** class LZ4::Dictionary ***/
+
+struct dictionary
 {
-    struct encoder *p = getencoder(enc);
-    size_t destsize = AUX_LZ4F_BLOCK_SIZE_MAX + AUX_LZ4F_FINISH_SIZE;
-    aux_str_reserve(p->workbuf, destsize);
-    char *destp = RSTRING_PTR(p->workbuf);
-    size_t size = LZ4F_compressEnd(p->encoder, destp, destsize, NULL);
-    aux_lz4f_check_error(size);
-    rb_str_set_len(p->workbuf, size);
-    rb_funcall2(p->outport, id_op_lshift, 1, &p->workbuf);
+    VALUE data;         /* frozen string */
+    LZ4F_CDict *cdict;
+    uint32_t id;
+};
 
-    return enc;
+static void
+dictionary_mark(void *pp)
+{
+    struct dictionary *p = pp;
+    rb_gc_mark(p->data);
 }
 
-static VALUE
-fenc_getoutport(VALUE enc)
+static void
+dictionary_free(void *pp)
 {
-    return getencoder(enc)->outport;
+    struct dictionary *p = pp;
+    if (p->cdict) {
+        LZ4F_freeCDict(p->cdict);
+    }
+    memset(p, 0, sizeof(*p));
+    xfree(p);
 }
 
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#   define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+static const rb_data_type_t dictionary_type = {
+    .wrap_struct_name = "extlz4.LZ4.Dictionary",
+    .function.dmark = dictionary_mark,
+    .function.dfree = dictionary_free,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
 static VALUE
-fenc_setoutport(VALUE enc, VALUE outport)
+fdic_alloc(VALUE mod)
 {
-    return getencoder(enc)->outport = outport;
+    struct dictionary *p;
+    VALUE obj = TypedData_Make_Struct(mod, struct dictionary, &dictionary_type, p);
+    p->data = Qnil;
+    return obj;
 }
 
-static VALUE
-fenc_prefs_level(VALUE enc)
+static struct dictionary *
+getdictionaryp(VALUE dic)
 {
-    return INT2NUM(aux_frame_level(&getencoder(enc)->prefs));
+    return getrefp(dic, &dictionary_type);
 }
 
-static int
-fenc_blocksize(struct encoder *p)
+static struct dictionary *
+getdictionary(VALUE dic)
 {
-    return aux_frame_blocksize(&p->prefs.frameInfo);
+    struct dictionary *p = getref(dic, &dictionary_type);
+    if (!p->cdict) {
+        checkref(dic, NULL);
+    }
+    return p;
+}
+
+/*
+ * nil であれば NULL を返す。LZ4::Dictionary でなければ例外を発生させる。
+ */
+static struct dictionary *
+aux_dictionary(VALUE dic)
+{
+    if (NIL_P(dic)) {
+        return NULL;
+    } else {
+        return getdictionary(dic);
+    }
+}
+
+/*
+ * call-seq:
+ *  initialize(data, dictid = 0) -> self
+ *
+ * LZ4 フレーム API のための事前辞書を作成します。
+ *
+ * 辞書の解析は作成時に一度だけ行われ、
+ * 以降は LZ4::Encoder と LZ4::Decoder の dictionary: 引数に与えることで再利用されます。
+ *
+ * 作成されたオブジェクトは変更不可能で、複数のスレッドから同時に利用できます。
+ *
+ * [data (String)]
+ *  辞書とする文字列です。64 KiB を超える場合は末尾の 64 KiB のみが用いられます。
+ *
+ * [dictid (Integer)]
+ *  フレームヘッダに記録される辞書 ID です。0 の場合は記録されません。
+ */
+static VALUE
+fdic_init(int argc, VALUE argv[], VALUE dic)
+{
+    struct dictionary *p = getref(dic, &dictionary_type);
+    VALUE data, dictid;
+    rb_scan_args(argc, argv, "11", &data, &dictid);
+    rb_check_frozen(dic);
+    rb_check_type(data, RUBY_T_STRING);
+
+    size_t size = RSTRING_LEN(data);
+    if (size > AUX_DICTIONARY_MAX) {
+        data = rb_str_subseq(data, size - AUX_DICTIONARY_MAX, AUX_DICTIONARY_MAX);
+    } else {
+        data = rb_str_dup(data);
+    }
+    p->data = rb_str_freeze(data);
+    p->id = NIL_P(dictid) ? 0 : NUM2UINT(dictid);
+    p->cdict = LZ4F_createCDict(RSTRING_PTR(p->data), RSTRING_LEN(p->data));
+    if (!p->cdict) {
+        rb_gc();
+        p->cdict = LZ4F_createCDict(RSTRING_PTR(p->data), RSTRING_LEN(p->data));
+        if (!p->cdict) {
+            errno = ENOMEM;
+            rb_sys_fail("failed LZ4F_createCDict()");
+        }
+    }
+
+    rb_obj_freeze(dic);
+
+    return dic;
 }
 
+/*
+ * call-seq:
+ *  data -> frozen string
+ */
 static VALUE
-fenc_prefs_blocksize(VALUE enc)
+fdic_data(VALUE dic)
 {
-    return INT2NUM(fenc_blocksize(getencoder(enc)));
+    return getdictionary(dic)->data;
 }
 
 static VALUE
-fenc_prefs_blocklink(VALUE enc)
+fdic_dictid(VALUE dic)
 {
-    return aux_frame_blocklink(&getencoder(enc)->prefs.frameInfo) ? Qtrue : Qfalse;
+    return UINT2NUM(getdictionary(dic)->id);
 }
 
 static VALUE
-fenc_prefs_checksum(VALUE enc)
+fdic_size(VALUE dic)
 {
-    return aux_frame_checksum(&getencoder(enc)->prefs.frameInfo) ? Qtrue : Qfalse;
+    return SIZET2NUM(RSTRING_LEN(getdictionary(dic)->data));
 }
 
 static VALUE
-fenc_inspect(VALUE enc)
+fdic_inspect(VALUE dic)
 {
-    struct encoder *p = getencoderp(enc);
-    if (p) {
-        return rb_sprintf("#<%s:%p outport=#<%s:%p>, level=%d, blocksize=%d, blocklink=%s, checksum=%s>",
-                rb_obj_classname(enc), (void *)enc,
-                rb_obj_classname(p->outport), (void *)p->outport,
-                p->prefs.compressionLevel, fenc_blocksize(p),
-                aux_frame_blocklink(&p->prefs.frameInfo) ? "true" : "false",
-                aux_frame_checksum(&p->prefs.frameInfo) ? "true" : "false");
+    struct dictionary *p = getdictionaryp(dic);
+    if (p && p->cdict) {
+        return rb_sprintf("#<%s:%p size=%d, dictid=%u>",
+                rb_obj_classname(dic), (void *)dic,
+                (int)RSTRING_LEN(p->data), (unsigned int)p->id);
     } else {
         return rb_sprintf("#<%s:%p **INVALID REFERENCE**>",
-                rb_obj_classname(enc), (void *)enc);
+                rb_obj_classname(dic), (void *)dic);
     }
 }
 
-/*** class LZ4::Decoder ***/
+/*** class LZ4::Encoder ***/
 
-struct decoder
+struct encoder
 {
-    VALUE inport;
-    VALUE readbuf;  /* read buffer from inport */
-    VALUE inbuf;
-    VALUE outbuf;
-    size_t outoff;  /* offset in outbuf */
-    size_t status;  /* status code of LZ4F_decompress */
-    LZ4F_frameInfo_t info;
-    LZ4F_decompressionContext_t decoder;
+    VALUE outport;
+    VALUE workbuf;
+    LZ4F_preferences_t prefs;
+    LZ4F_compressionContext_t encoder;
+    VALUE dictionary;   /* LZ4::Dictionary or nil */
+    const LZ4F_CDict *cdict;
+    int outdirect;      /* 真であれば outport のファイル記述子へ直接書き込む */
+
+    /*
+     * 以下は独立ブロック (blocklink: false) を LZ4F_compressUpdate に頼らずに組み立てる場合に使う。
+     *
+     * 出力されるフレームは LZ4F_compressUpdate を用いた場合と同一になる。
+     * threads、adaptive、skip_incompressible、index、deadline のいずれかを与えた場合か、
+     * #write_raw を呼んだ場合にこちらへ切り替える。
+     */
+    int threads;
+    int manual;                         /* 真であればブロックを自前で組み立てる */
+    int fed;                            /* 真であれば現在のフレームへ LZ4F_compressUpdate でデータを与えた */
+    LZ4F_compressionContext_t *workers; /* threads 個のブロック圧縮用コンテキスト */
+    LZ4F_preferences_t blockprefs;      /* ブロック圧縮用の設定 */
+    char *pending;                      /* ブロックに満たない入力データ */
+    size_t pendingsize;
+    XXH32_state_t checksum;             /* LZ4F_compressUpdate で与えたデータも含む */
+    int adaptive;                       /* 真であればブロックごとに圧縮レベルを切り替える */
+    int adaptive_index;                 /* aux_adaptive_levels の現在位置 */
+    int skip_incompressible;            /* 真であれば圧縮できそうにないブロックを圧縮せずに格納する */
+    int index;                          /* 真であればフレームの後にシーク用索引を出力する */
+    VALUE indexbuf;                     /* シーク用索引のブロック情報 */
+    uint32_t headersize;
+    double deadline;                    /* 0 以外であれば一回の呼び出しで圧縮に費やす秒数の目安 */
+    double deadline_at;                 /* 現在の呼び出しの期限 */
+    double comprate;                    /* 本来の圧縮レベルで 1 バイトの圧縮に要した秒数の見積もり */
+
+    struct aux_stats stats;
 };
 
 static void
-decoder_mark(void *pp)
+encoder_mark(void *pp)
 {
-    struct decoder *p = pp;
-    rb_gc_mark(p->inport);
-    rb_gc_mark(p->readbuf);
-    rb_gc_mark(p->inbuf);
-    rb_gc_mark(p->outbuf);
+    struct encoder *p = pp;
+    rb_gc_mark(p->outport);
+    rb_gc_mark(p->workbuf);
+    rb_gc_mark(p->dictionary);
+    rb_gc_mark(p->indexbuf);
 }
 
 static void
-decoder_free(void *pp)
+encoder_free(void *pp)
 {
-    struct decoder *p = pp;
-    if (p->decoder) {
-        LZ4F_freeDecompressionContext(p->decoder);
+    struct encoder *p = pp;
+    if (p->encoder) {
+        LZ4F_freeCompressionContext(p->encoder);
+    }
+    if (p->workers) {
+        int i;
+        for (i = 0; i < p->threads; i ++) {
+            if (p->workers[i]) {
+                LZ4F_freeCompressionContext(p->workers[i]);
+            }
+        }
+        xfree(p->workers);
+    }
+    if (p->pending) {
+        xfree(p->pending);
     }
     memset(p, 0, sizeof(*p));
     xfree(p);
 }
 
-static const rb_data_type_t decoder_type = {
-    .wrap_struct_name = "extlz4.LZ4.Decoder",
-    .function.dmark = decoder_mark,
-    .function.dfree = decoder_free,
-    /* .function.dsize = decoder_size, */
+static const rb_data_type_t encoder_type = {
+    .wrap_struct_name = "extlz4.LZ4.Encoder",
+    .function.dmark = encoder_mark,
+    .function.dfree = encoder_free,
+    /* .function.dsize = encoder_size, */
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
 
 static VALUE
-fdec_alloc(VALUE mod)
+fenc_alloc(VALUE mod)
 {
-    struct decoder *p;
-    VALUE obj = TypedData_Make_Struct(mod, struct decoder, &decoder_type, p);
-    p->inport = Qnil;
-    p->readbuf = Qnil;
-    p->inbuf = Qnil;
-    p->outbuf = Qnil;
-    p->outoff = 0;
-    p->status = 0;
+    struct encoder *p;
+    VALUE obj = TypedData_Make_Struct(mod, struct encoder, &encoder_type, p);
+    p->outport = Qnil;
+    p->workbuf = Qnil;
+    p->dictionary = Qnil;
+    p->indexbuf = Qnil;
+    p->threads = 1;
     return obj;
 }
 
-static struct decoder *
-getdecoderp(VALUE dec)
+static inline int
+fenc_init_args_blocksize(size_t size)
 {
-    return getrefp(dec, &decoder_type);
+    if (size == 0) {
+        return LZ4F_default;
+    } else if (size <= 64 * 1024) {
+        return LZ4F_max64KB;
+    } else if (size <= 256 * 1024) {
+        return LZ4F_max256KB;
+    } else if (size <= 1 * 1024 * 1024) {
+        return LZ4F_max1MB;
+    } else {
+        return LZ4F_max4MB;
+    }
 }
 
-static struct decoder *
-getdecoder(VALUE dec)
+static inline void
+fenc_init_args_prefs(VALUE level, VALUE opts, struct encoder *p)
+{
+    LZ4F_preferences_t *prefs = &p->prefs;
+    memset(prefs, 0, sizeof(*prefs));
+
+    prefs->compressionLevel = NIL_P(level) ? 1 : NUM2INT(level);
+
+    if (!NIL_P(opts)) {
+        VALUE blocksize, blocklink, checksum, threads, adaptive, skip_incompressible, index, deadline;
+        RBX_SCANHASH(opts, Qnil,
+                RBX_SCANHASH_ARGS("blocksize", &blocksize, Qnil),
+                RBX_SCANHASH_ARGS("blocklink", &blocklink, Qfalse),
+                RBX_SCANHASH_ARGS("checksum", &checksum, Qtrue),
+                RBX_SCANHASH_ARGS("threads", &threads, Qnil),
+                RBX_SCANHASH_ARGS("dictionary", &p->dictionary, Qnil),
+                RBX_SCANHASH_ARGS("adaptive", &adaptive, Qfalse),
+                RBX_SCANHASH_ARGS("skip_incompressible", &skip_incompressible, Qfalse),
+                RBX_SCANHASH_ARGS("index", &index, Qfalse),
+                RBX_SCANHASH_ARGS("deadline", &deadline, Qnil));
+        // prefs->autoFlush = TODO;
+        prefs->frameInfo.blockSizeID = NIL_P(blocksize) ? LZ4F_default : fenc_init_args_blocksize(NUM2INT(blocksize));
+        prefs->frameInfo.blockMode = RTEST(blocklink) ? LZ4F_blockLinked : LZ4F_blockIndependent;
+        prefs->frameInfo.contentChecksumFlag = RTEST(checksum) ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum;
+        p->threads = aux_threads(threads);
+        if (NIL_P(blocksize) && p->threads > 1) {
+            /* 並列に圧縮する場合は、ブロックを分割する長さを明示する */
+            prefs->frameInfo.blockSizeID = LZ4F_max64KB;
+        }
+        struct dictionary *dic = aux_dictionary(p->dictionary);
+        p->cdict = dic ? dic->cdict : NULL;
+        prefs->frameInfo.dictID = dic ? dic->id : 0;
+        p->adaptive = RTEST(adaptive);
+        if (p->adaptive && prefs->frameInfo.blockMode != LZ4F_blockIndependent) {
+            rb_raise(rb_eArgError, "adaptive: true needs blocklink: false");
+        }
+        p->skip_incompressible = RTEST(skip_incompressible);
+        if (p->skip_incompressible && prefs->frameInfo.blockMode != LZ4F_blockIndependent) {
+            rb_raise(rb_eArgError, "skip_incompressible: true needs blocklink: false");
+        }
+        p->index = RTEST(index);
+        if (p->index && prefs->frameInfo.blockMode != LZ4F_blockIndependent) {
+            rb_raise(rb_eArgError, "index: true needs blocklink: false");
+        }
+        p->deadline = NIL_P(deadline) ? 0 : NUM2DBL(deadline);
+        if (!NIL_P(deadline) && !(p->deadline > 0)) {
+            rb_raise(rb_eArgError, "deadline: must be positive");
+        }
+        if (p->deadline > 0 && prefs->frameInfo.blockMode != LZ4F_blockIndependent) {
+            rb_raise(rb_eArgError, "deadline: needs blocklink: false");
+        }
+    } else {
+        prefs->frameInfo.blockSizeID = LZ4F_default;
+        prefs->frameInfo.blockMode = LZ4F_blockIndependent;
+        prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+        p->threads = 1;
+        p->dictionary = Qnil;
+        p->cdict = NULL;
+        p->adaptive = 0;
+        p->skip_incompressible = 0;
+        p->index = 0;
+        p->deadline = 0;
+    }
+}
+
+static inline void
+fenc_init_args(int argc, VALUE argv[], VALUE *outport, struct encoder *p)
+{
+    VALUE level, opts;
+    rb_scan_args(argc, argv, "02:", outport, &level, &opts);
+
+    if (NIL_P(*outport)) {
+        *outport = rb_str_buf_new(0);
+    }
+
+    fenc_init_args_prefs(level, opts, p);
+}
+
+static struct encoder *
+getencoderp(VALUE enc)
+{
+    return getrefp(enc, &encoder_type);
+}
+
+static struct encoder *
+getencoder(VALUE enc)
+{
+    return getref(enc, &encoder_type);
+}
+
+/*
+ * 実際にフレームへ書かれるブロックの最大長。
+ *
+ * LZ4F_default の場合、#prefs_blocksize は従来通り 4 MiB を返すが、
+ * LZ4F は LZ4F_BLOCKSIZEID_DEFAULT (64 KiB) で圧縮する。
+ */
+static int
+fenc_blocksize(struct encoder *p)
+{
+    if (p->prefs.frameInfo.blockSizeID == LZ4F_default) {
+        return 64 * 1024;
+    }
+    return aux_frame_blocksize(&p->prefs.frameInfo);
+}
+
+/*
+ * p->workbuf の内容を outport へ出力する。
+ */
+static void
+fenc_output(struct encoder *p)
+{
+    double t = aux_clock_now();
+    p->stats.bytes_out += RSTRING_LEN(p->workbuf);
+    aux_stats_scan(&p->stats, RSTRING_PTR(p->workbuf), RSTRING_LEN(p->workbuf));
+    if (p->outdirect) {
+        aux_io_write_direct(p->outport, RSTRING_PTR(p->workbuf), RSTRING_LEN(p->workbuf));
+    } else {
+        rb_funcall2(p->outport, id_op_lshift, 1, &p->workbuf);
+    }
+    p->stats.io_time += aux_clock_now() - t;
+
+    /* 圧縮の間に保留された割り込みを、出力を終えて状態が整ってから処理する */
+    rb_thread_check_ints();
+}
+
+static void
+fenc_set_outport(struct encoder *p, VALUE outport)
+{
+    p->outport = outport;
+    p->outdirect = aux_io_direct_writable_p(outport);
+}
+
+static void
+fenc_setup_manual(struct encoder *p)
+{
+    int i;
+
+    p->manual = 1;
+    p->blockprefs = p->prefs;
+    p->blockprefs.autoFlush = 1;
+    p->blockprefs.frameInfo.contentChecksumFlag = LZ4F_noContentChecksum;
+    p->blockprefs.frameInfo.contentSize = 0;
+
+    if (p->adaptive) {
+        /* 指定された圧縮レベル以上で最も近いものから始める */
+        for (p->adaptive_index = 0; p->adaptive_index < AUX_ADAPTIVE_LEVELS - 1; p->adaptive_index ++) {
+            if (aux_adaptive_levels[p->adaptive_index] >= p->prefs.compressionLevel) {
+                break;
+            }
+        }
+        p->blockprefs.compressionLevel = aux_adaptive_levels[p->adaptive_index];
+    }
+
+    p->workers = ALLOC_N(LZ4F_compressionContext_t, p->threads);
+    memset(p->workers, 0, sizeof(*p->workers) * p->threads);
+    for (i = 0; i < p->threads; i ++) {
+        aux_lz4f_check_error(LZ4F_createCompressionContext(&p->workers[i], LZ4F_VERSION));
+    }
+}
+
+/*
+ * 新しいフレームを開始して、フレームヘッダを outport へ出力する。
+ *
+ * 圧縮コンテキストと作業バッファは作成済みのものを使い回す。
+ */
+static void
+fenc_begin_manual(struct encoder *p)
+{
+    if (!p->pending) {
+        p->pending = ALLOC_N(char, fenc_blocksize(p));
+    }
+    p->pendingsize = 0;
+}
+
+static void
+fenc_begin(struct encoder *p, VALUE outport)
+{
+    if (p->manual) {
+        fenc_begin_manual(p);
+    }
+    p->fed = 0;
+    XXH32_reset(&p->checksum, 0);
+    aux_str_reserve(p->workbuf, AUX_LZ4FRAME_HEADER_MAX);
+    size_t s = aux_LZ4F_compressBegin(p->encoder, RSTRING_PTR(p->workbuf), rb_str_capacity(p->workbuf), p->cdict, &p->prefs);
+    aux_lz4f_check_error(s);
+    rb_str_set_len(p->workbuf, s);
+    fenc_set_outport(p, outport);
+    aux_stats_begin(&p->stats, s, 0);
+    if (p->index) {
+        if (NIL_P(p->indexbuf)) {
+            p->indexbuf = rb_str_tmp_new(0);
+        }
+        rb_str_set_len(p->indexbuf, 0);
+        p->headersize = (uint32_t)s;
+    }
+    fenc_output(p);
+}
+
+static void
+fenc_setup(struct encoder *p, VALUE outport)
+{
+    LZ4F_errorCode_t status;
+    status = LZ4F_createCompressionContext(&p->encoder, LZ4F_VERSION);
+    aux_lz4f_check_error(status);
+    if (p->prefs.frameInfo.blockMode == LZ4F_blockIndependent &&
+            (p->threads > 1 || p->adaptive || p->skip_incompressible || p->index || p->deadline > 0)) {
+        fenc_setup_manual(p);
+    }
+    p->workbuf = rb_str_buf_new(AUX_LZ4F_BLOCK_SIZE_MAX);
+    fenc_begin(p, outport);
+}
+
+/*
+ * call-seq:
+ *  initialize(outport = "".b, level = 1, blocksize: nil, blocklink: false, checksum: true, threads: nil, dictionary: nil, adaptive: false, skip_incompressible: false, index: false, deadline: nil)
+ *
+ * [threads: nil (Integer)]
+ *  独立ブロック (blocklink: false) の場合に、ブロックの圧縮処理を並列に行うスレッド数を指定します。
+ *
+ *  nil または 1 以下であれば並列化しません。blocklink: true の場合は無視されます。
+ *
+ *  並列化の有無にかかわらず、出力されるデータは同一です。
+ *  blocksize を省略して threads に 2 以上を与えた場合、#prefs_blocksize は実際のブロック長である 64 KiB を返します。
+ *
+ * [dictionary: nil (LZ4::Dictionary)]
+ *  事前辞書を指定します。展開時にも同じ辞書を与える必要があります。
+ *
+ *  辞書 ID が 0 以外であれば、フレームヘッダに記録されます。
+ *
+ * [adaptive: false (true or false)]
+ *  真を与えた場合、ブロックごとに圧縮レベルを切り替えます。blocklink: false である必要があります。
+ *
+ *  圧縮に要した時間と outport への出力に要した時間を比較して、
+ *  出力が滞っていれば高効率圧縮の側へ、圧縮が追いついていなければ高速圧縮の側へ一段階ずつ移ります。
+ *
+ *  level は初期値として扱われます。現在の圧縮レベルは #prefs_level で確認できます。
+ *
+ * [skip_incompressible: false (true or false)]
+ *  真を与えた場合、ブロックの一部を抜き出してバイト値の偏りを調べ、
+ *  圧縮済みの画像や暗号化されたデータのように圧縮できそうにないブロックは圧縮を試みずに格納します。
+ *  blocklink: false である必要があります。
+ *
+ * [index: false (true or false)]
+ *  真を与えた場合、各ブロックの圧縮後と展開後の長さを記録したシーク用索引を
+ *  スキップ可能フレームとしてフレームの直後に出力します。blocklink: false である必要があります。
+ *
+ *  索引は LZ4::Decoder#seek や LZ4::Decoder#pos= で用いられます。
+ *  索引を解釈しない展開器 (lz4 コマンドなど) では読み飛ばされます。
+ *
+ * [deadline: nil (Float)]
+ *  #write や #close などの一回の呼び出しで圧縮に費やす秒数の目安を指定します。blocklink: false である必要があります。
+ *
+ *  それまでの圧縮速度から期限に間に合わないと見込まれたブロックは、
+ *  本来の圧縮レベルの代わりに圧縮レベル 1 で圧縮されます。該当したブロック数は #stats で確認できます。
+ *  圧縮速度の見積もりがない最初のブロック (threads が 2 以上であれば最初の threads 個のブロック) は、
+ *  常に本来の圧縮レベルで圧縮されます。
+ *
+ * 圧縮はブロック (threads が 2 以上であれば threads 個のブロック) ごとに区切って行われ、
+ * Thread#raise や Timeout、シグナルによる割り込みはその区切りで処理されます。
+ * 割り込みによって例外が発生した場合でも、それまでに出力されたブロックはフレームとして正しいままです。
+ *
+ * outport が IO#<< や IO#write を再定義していないバイナリモードの IO であれば、
+ * ruby のメソッドを経由せずにファイル記述子へ直接書き込みます。
+ */
+static VALUE
+fenc_init(int argc, VALUE argv[], VALUE enc)
+{
+    struct encoder *p = getencoder(enc);
+    VALUE outport;
+    fenc_init_args(argc, argv, &outport, p);
+    fenc_setup(p, outport);
+    return enc;
+}
+
+struct fenc_block
+{
+    const char *src;
+    size_t srcsize;
+    char *dest;
+    size_t destsize;
+    size_t size;        /* 出力されたバイト数、または LZ4F のエラーコード */
+    int done;           /* 真であれば圧縮を終えている */
+};
+
+struct fenc_blocks
+{
+    struct encoder *encoder;
+    const LZ4F_preferences_t *prefs;    /* ブロック圧縮用の設定 (deadline: による切り替えを反映したもの) */
+    struct fenc_block *blocks;
+    size_t nblocks;
+    volatile int canceled;
+};
+
+static void
+fenc_blocks_encode_block(void *arg, size_t index, int worker)
+{
+    struct fenc_blocks *b = arg;
+    struct encoder *p = b->encoder;
+    struct fenc_block *blk = &b->blocks[index];
+    LZ4F_compressionContext_t cx = p->workers[worker];
+    char header[AUX_LZ4FRAME_HEADER_MAX];
+
+    if (b->canceled) {
+        return;
+    }
+
+    blk->done = 1;
+
+    if (p->skip_incompressible && aux_incompressible_p(blk->src, blk->srcsize)) {
+        blk->size = aux_frame_stored_block(blk->dest, blk->src, blk->srcsize);
+        return;
+    }
+
+    /*
+     * フレームヘッダは fenc_init で出力済みなので捨てる。
+     * autoFlush が有効なので、ブロックが一つだけ出力される。
+     */
+    size_t s = LZ4F_compressBegin_usingCDict(cx, header, sizeof(header), p->cdict, b->prefs);
+    if (!LZ4F_isError(s)) {
+        s = LZ4F_compressUpdate(cx, blk->dest, blk->destsize, blk->src, blk->srcsize, NULL);
+    }
+    blk->size = s;
+}
+
+static void *
+fenc_blocks_encode_nogvl(va_list *vp)
+{
+    struct fenc_blocks *b = va_arg(*vp, struct fenc_blocks *);
+    struct encoder *p = b->encoder;
+    size_t i;
+
+    extlz4_parallel_run(p->threads, b->nblocks, fenc_blocks_encode_block, b);
+
+    /* 中断された場合は、先頭から続けて圧縮を終えたブロックだけを出力する */
+    if (aux_frame_checksum(&p->prefs.frameInfo)) {
+        for (i = 0; i < b->nblocks && b->blocks[i].done; i ++) {
+            XXH32_update(&p->checksum, b->blocks[i].src, b->blocks[i].srcsize);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+fenc_blocks_encode_cancel(va_list *vp)
+{
+    struct fenc_blocks *b = va_arg(*vp, struct fenc_blocks *);
+    b->canceled = 1;
+}
+
+/*
+ * deadline: の期限を現在の呼び出しに合わせる。
+ */
+static void
+fenc_deadline_begin(struct encoder *p)
+{
+    if (p->deadline > 0) {
+        p->deadline_at = aux_clock_now() + p->deadline;
+    }
+}
+
+/*
+ * 本来の圧縮レベルで size バイトを圧縮すると deadline: の期限を過ぎると見込まれる場合に真を返す。
+ *
+ * 圧縮速度の見積もりがまだなければ、見積もりを得るために本来の圧縮レベルで圧縮させる。
+ */
+static int
+fenc_deadline_p(struct encoder *p, size_t size)
+{
+    if (p->deadline <= 0 || p->blockprefs.compressionLevel <= AUX_DEADLINE_LEVEL || p->comprate <= 0) {
+        return 0;
+    }
+
+    return aux_clock_now() + p->comprate * size > p->deadline_at;
+}
+
+/*
+ * 圧縮に要した時間 comptime と出力に要した時間 outtime から、次のブロックの圧縮レベルを決める。
+ *
+ * どちらかが他方の2倍を超えた場合にのみ一段階ずつ移動する。
+ */
+static void
+fenc_adapt(struct encoder *p, double comptime, double outtime)
+{
+    int i = p->adaptive_index;
+
+    if (outtime > comptime * 2) {
+        if (i < AUX_ADAPTIVE_LEVELS - 1) { i ++; }
+    } else if (comptime > outtime * 2) {
+        if (i > 0) { i --; }
+    }
+
+    p->adaptive_index = i;
+    p->blockprefs.compressionLevel = aux_adaptive_levels[i];
+}
+
+/*
+ * シーク用索引にブロックの情報を加える。
+ */
+static void
+fenc_index_add(struct encoder *p, size_t csize, size_t usize)
+{
+    if (p->index) {
+        char ent[8];
+        aux_write_le32(ent, (uint32_t)csize);
+        aux_write_le32(ent + 4, (uint32_t)usize);
+        rb_str_buf_cat(p->indexbuf, ent, sizeof(ent));
+    }
+}
+
+/*
+ * 終端マークを含む workbuf の後ろに、シーク用索引のスキップ可能フレームを追加する。
+ */
+static void
+fenc_index_finish(struct encoder *p, size_t trailersize)
+{
+    size_t entsize = RSTRING_LEN(p->indexbuf);
+    size_t size = RSTRING_LEN(p->workbuf);
+    aux_str_reserve(p->workbuf, size + 8 + entsize + AUX_SEEK_INDEX_FOOTER);
+    char *q = RSTRING_PTR(p->workbuf) + size;
+    aux_write_le32(q, AUX_SEEK_INDEX_MAGIC);
+    aux_write_le32(q + 4, (uint32_t)(entsize + AUX_SEEK_INDEX_FOOTER));
+    memcpy(q + 8, RSTRING_PTR(p->indexbuf), entsize);
+    q += 8 + entsize;
+    aux_write_le32(q, p->headersize);
+    aux_write_le32(q + 4, (uint32_t)trailersize);
+    aux_write_le32(q + 8, (uint32_t)(entsize / 8));
+    aux_write_le32(q + 12, AUX_SEEK_INDEX_SIGNATURE);
+    rb_str_set_len(p->workbuf, size + 8 + entsize + AUX_SEEK_INDEX_FOOTER);
+    rb_str_set_len(p->indexbuf, 0);
+}
+
+/*
+ * ブロックをまとめて圧縮して outport へ出力する。
+ *
+ * 割り込まれた場合は圧縮を終えたブロックまでを出力してから割り込みを処理し、
+ * 例外が発生しなければ残りのブロックを続けて圧縮する。
+ */
+static void
+fenc_blocks_encode(struct encoder *p, struct fenc_block *blocks, size_t nblocks)
+{
+    size_t bound = LZ4F_compressBound(fenc_blocksize(p), &p->blockprefs);
+    size_t i, srcsize = 0;
+
+    for (i = 0; i < nblocks; i ++) {
+        srcsize += blocks[i].srcsize;
+    }
+
+    const int fallback = fenc_deadline_p(p, srcsize);
+    LZ4F_preferences_t fallbackprefs = p->blockprefs;
+    fallbackprefs.compressionLevel = AUX_DEADLINE_LEVEL;
+    double comptime = 0, outtime = 0;
+
+    while (nblocks > 0) {
+        aux_str_reserve(p->workbuf, bound * nblocks);
+        char *destp = RSTRING_PTR(p->workbuf);
+        for (i = 0; i < nblocks; i ++) {
+            blocks[i].dest = destp + bound * i;
+            blocks[i].destsize = bound;
+            blocks[i].done = 0;
+        }
+
+        struct fenc_blocks b = { p, fallback ? &fallbackprefs : &p->blockprefs, blocks, nblocks, 0 };
+        double t = aux_clock_now();
+        aux_thread_call_without_gvl2(fenc_blocks_encode_nogvl, fenc_blocks_encode_cancel, &b);
+        t = aux_clock_now() - t;
+        comptime += t;
+        p->stats.codec_time += t;
+
+        size_t size = 0, n;
+        for (n = 0; n < nblocks && blocks[n].done; n ++) {
+            aux_lz4f_check_error(blocks[n].size);
+            memmove(destp + size, blocks[n].dest, blocks[n].size);
+            size += blocks[n].size;
+            fenc_index_add(p, blocks[n].size, blocks[n].srcsize);
+        }
+        if (fallback) {
+            p->stats.fallback_blocks += n;
+        }
+        blocks += n;
+        nblocks -= n;
+
+        rb_str_set_len(p->workbuf, size);
+        t = p->stats.io_time;
+        fenc_output(p);
+        outtime += p->stats.io_time - t;
+    }
+
+    if (fallback) {
+        return;
+    }
+
+    if (p->deadline > 0 && srcsize > 0) {
+        double rate = comptime / srcsize;
+        p->comprate = (p->comprate > 0) ? (p->comprate * 3 + rate) / 4 : rate;
+    }
+
+    if (p->adaptive) {
+        fenc_adapt(p, comptime, outtime);
+    }
+}
+
+static void
+fenc_check_manual(struct encoder *p)
+{
+    if (!p->pending) {
+        aux_lz4f_check_error((size_t)-LZ4F_ERROR_compressionState_uninitialized);
+    }
+}
+
+static void
+fenc_update_manual(struct encoder *p, const char *srcp, const char *srctail)
+{
+    const size_t blocksize = fenc_blocksize(p);
+    struct fenc_block blocks[p->threads];
+    size_t n = 0;
+
+    fenc_check_manual(p);
+
+    if (p->pendingsize > 0) {
+        size_t s = blocksize - p->pendingsize;
+        if (s > (size_t)(srctail - srcp)) { s = srctail - srcp; }
+        memcpy(p->pending + p->pendingsize, srcp, s);
+        p->pendingsize += s;
+        srcp += s;
+        if (p->pendingsize < blocksize) {
+            return;
+        }
+
+        blocks[n ++] = (struct fenc_block){ .src = p->pending, .srcsize = blocksize };
+        p->pendingsize = 0;
+    }
+
+    while ((size_t)(srctail - srcp) >= blocksize) {
+        if (n >= (size_t)p->threads) {
+            fenc_blocks_encode(p, blocks, n);
+            n = 0;
+        }
+        blocks[n ++] = (struct fenc_block){ .src = srcp, .srcsize = blocksize };
+        srcp += blocksize;
+    }
+
+    if (n > 0) {
+        fenc_blocks_encode(p, blocks, n);
+    }
+
+    p->pendingsize = srctail - srcp;
+    memcpy(p->pending, srcp, p->pendingsize);
+}
+
+static void
+fenc_flush_manual(struct encoder *p)
+{
+    fenc_check_manual(p);
+
+    if (p->pendingsize > 0) {
+        struct fenc_block block = { .src = p->pending, .srcsize = p->pendingsize };
+        p->pendingsize = 0;
+        fenc_blocks_encode(p, &block, 1);
+    }
+}
+
+static void
+fenc_close_manual(struct encoder *p)
+{
+    fenc_flush_manual(p);
+
+    aux_str_reserve(p->workbuf, 8);
+    char *destp = RSTRING_PTR(p->workbuf);
+    size_t size = 4;
+    aux_write_le32(destp, 0); /* end mark */
+    if (aux_frame_checksum(&p->prefs.frameInfo)) {
+        aux_write_le32(destp + 4, XXH32_digest(&p->checksum));
+        size += 4;
+    }
+    rb_str_set_len(p->workbuf, size);
+    if (p->index) {
+        fenc_index_finish(p, size);
+    }
+
+    xfree(p->pending);
+    p->pending = NULL;
+
+    fenc_output(p);
+}
+
+/*
+ * src を圧縮せずに、非圧縮ブロックとして出力する。
+ */
+static void
+fenc_write_raw_manual(struct encoder *p, const char *srcp, const char *srctail)
+{
+    const size_t blocksize = fenc_blocksize(p);
+
+    fenc_flush_manual(p);
+
+    while (srcp < srctail) {
+        size_t s = srctail - srcp;
+        if (s > blocksize) { s = blocksize; }
+        aux_str_reserve(p->workbuf, s + 4);
+        rb_str_set_len(p->workbuf, aux_frame_stored_block(RSTRING_PTR(p->workbuf), srcp, s));
+        fenc_index_add(p, RSTRING_LEN(p->workbuf), s);
+        if (aux_frame_checksum(&p->prefs.frameInfo)) {
+            XXH32_update(&p->checksum, srcp, s);
+        }
+        fenc_output(p);
+        srcp += s;
+    }
+}
+
+/*
+ * LZ4F_compressUpdate に与えるデータの内容のチェックサムを、LZ4F とは別に計算するか。
+ *
+ * #write_raw で自前でブロックを組み立てる方法へ切り替えた後に引き継ぐために使う。
+ */
+static inline int
+fenc_track_checksum_p(struct encoder *p)
+{
+    return p->prefs.frameInfo.blockMode == LZ4F_blockIndependent && aux_frame_checksum(&p->prefs.frameInfo);
+}
+
+static inline void
+fenc_update(struct encoder *p, VALUE src, LZ4F_compressOptions_t *opts)
+{
+    rb_check_type(src, RUBY_T_STRING);
+    const char *srcp = RSTRING_PTR(src);
+    const char *srctail = srcp + RSTRING_LEN(src);
+    p->stats.bytes_in += RSTRING_LEN(src);
+    if (p->manual) {
+        fenc_deadline_begin(p);
+        fenc_update_manual(p, srcp, srctail);
+        return;
+    }
+    if (srcp < srctail) {
+        p->fed = 1;
+    }
+    while (srcp < srctail) {
+        size_t srcsize = srctail - srcp;
+        if (srcsize > AUX_LZ4F_BLOCK_SIZE_MAX) { srcsize = AUX_LZ4F_BLOCK_SIZE_MAX; }
+        size_t destsize = LZ4F_compressBound(srcsize, &p->prefs);
+        aux_str_reserve(p->workbuf, destsize);
+        char *destp = RSTRING_PTR(p->workbuf);
+        double t = aux_clock_now();
+        size_t size = aux_LZ4F_compressUpdate(p->encoder, destp, destsize, srcp, srcsize, opts);
+        p->stats.codec_time += aux_clock_now() - t;
+        aux_lz4f_check_error(size);
+        if (fenc_track_checksum_p(p)) {
+            /* 割り込みで途中から戻っても LZ4F に与えた分と一致するよう、与えるたびに加える */
+            XXH32_update(&p->checksum, srcp, srcsize);
+        }
+        rb_str_set_len(p->workbuf, size);
+        fenc_output(p);
+        srcp += srcsize;
+    }
+}
+
+/*
+ * call-seq:
+ *  write(src) -> self
+ */
+static VALUE
+fenc_write(int argc, VALUE argv[], VALUE enc)
+{
+    struct encoder *p = getencoder(enc);
+    VALUE src;
+    rb_scan_args(argc, argv, "1", &src);
+    fenc_update(p, src, NULL);
+    return enc;
+}
+
+/*
+ * LZ4F_compressUpdate で圧縮途中のデータを出力する。end が真であればフレームを閉じる。
+ */
+static void
+fenc_flush_lz4f(struct encoder *p, int end)
+{
+    size_t destsize = AUX_LZ4F_BLOCK_SIZE_MAX + AUX_LZ4F_FINISH_SIZE;
+    aux_str_reserve(p->workbuf, destsize);
+    char *destp = RSTRING_PTR(p->workbuf);
+    double t = aux_clock_now();
+    size_t size = aux_LZ4F_flush(p->encoder, destp, destsize, end);
+    p->stats.codec_time += aux_clock_now() - t;
+    aux_lz4f_check_error(size);
+    rb_str_set_len(p->workbuf, size);
+    fenc_output(p);
+}
+
+/*
+ * フレームの途中でブロックを自前で組み立てる方法へ切り替える。
+ *
+ * 内容のチェックサムは LZ4F とは別に計算してあるため、そのまま引き継ぐ。
+ */
+static void
+fenc_switch_manual(struct encoder *p)
+{
+    if (p->prefs.frameInfo.blockMode != LZ4F_blockIndependent) {
+        rb_raise(extlz4_eError, "write_raw needs blocklink: false");
+    }
+    if (p->fed) {
+        fenc_flush_lz4f(p, 0);
+    }
+    fenc_setup_manual(p);
+    fenc_begin_manual(p);
+}
+
+/*
+ * call-seq:
+ *  write_raw(src) -> self
+ *
+ * src を圧縮せずに、非圧縮ブロックとして出力します。
+ *
+ * 圧縮済みであることが分かっているデータに対して圧縮処理を省くために用います。
+ * それまでに与えられたブロックに満たないデータは、先にブロックとして出力されます。
+ *
+ * blocklink: false である必要があります。
+ *
+ * threads、skip_incompressible、index、deadline のいずれも与えていない場合、
+ * 最初の呼び出しでブロックを自前で組み立てる方法へ切り替えます。
+ * それまでに #write などで与えたデータは、切り替える前にブロックとして出力されます。
+ */
+static VALUE
+fenc_write_raw(VALUE enc, VALUE src)
+{
+    struct encoder *p = getencoder(enc);
+    rb_check_type(src, RUBY_T_STRING);
+    if (!p->manual) {
+        fenc_switch_manual(p);
+    }
+    p->stats.bytes_in += RSTRING_LEN(src);
+    fenc_deadline_begin(p);
+    fenc_write_raw_manual(p, RSTRING_PTR(src), RSTRING_END(src));
+    RB_GC_GUARD(src);
+    return enc;
+}
+
+static VALUE
+fenc_push(VALUE enc, VALUE src)
+{
+    struct encoder *p = getencoder(enc);
+    fenc_update(p, src, NULL);
+    return enc;
+}
+
+static VALUE
+fenc_flush(VALUE enc)
+{
+    struct encoder *p = getencoder(enc);
+    if (p->manual) {
+        fenc_deadline_begin(p);
+        fenc_flush_manual(p);
+        return enc;
+    }
+    fenc_flush_lz4f(p, 0);
+
+    return enc;
+}
+
+static VALUE
+fenc_close(VALUE enc)
+{
+    struct encoder *p = getencoder(enc);
+    if (p->manual) {
+        fenc_deadline_begin(p);
+        fenc_close_manual(p);
+        return enc;
+    }
+    fenc_flush_lz4f(p, 1);
+
+    return enc;
+}
+
+/*
+ * call-seq:
+ *  reset(outport = "".b) -> self
+ *
+ * 圧縮途中のデータを破棄して、同じ設定で新しいフレームを開始します。
+ *
+ * 圧縮コンテキストと作業バッファは再利用されるため、
+ * 多数の小さなフレームを作成する場合に LZ4::Encoder.new を繰り返すよりも効率的です。
+ */
+static VALUE
+fenc_reset(int argc, VALUE argv[], VALUE enc)
+{
+    struct encoder *p = getencoder(enc);
+    VALUE outport;
+    rb_scan_args(argc, argv, "01", &outport);
+    if (NIL_P(outport)) {
+        outport = rb_str_buf_new(0);
+    }
+    fenc_begin(p, outport);
+    return enc;
+}
+
+/*
+ * LZ4.encode (LZ4::Encoder.encode) のためにスレッドごとに保持される圧縮コンテキスト。
+ *
+ * スレッド変数に置くため、同じスレッドのファイバーは一つのコンテキストを共有する。
+ */
+
+struct cctx_pool
+{
+    LZ4F_compressionContext_t cctx;
+};
+
+static void
+cctx_pool_free(void *pp)
+{
+    struct cctx_pool *p = pp;
+    if (p->cctx) {
+        LZ4F_freeCompressionContext(p->cctx);
+    }
+    xfree(p);
+}
+
+static const rb_data_type_t cctx_pool_type = {
+    .wrap_struct_name = "extlz4.LZ4.Encoder.cctx_pool",
+    .function.dmark = NULL,
+    .function.dfree = cctx_pool_free,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+aux_cctx_pool(void)
+{
+    VALUE pool = aux_thread_pool_get(id_cctx_pool, &cctx_pool_type);
+
+    if (NIL_P(pool)) {
+        struct cctx_pool *p;
+        pool = TypedData_Make_Struct(rb_cObject, struct cctx_pool, &cctx_pool_type, p);
+        aux_lz4f_check_error(LZ4F_createCompressionContext(&p->cctx, LZ4F_VERSION));
+        aux_thread_pool_set(id_cctx_pool, pool);
+    }
+
+    return pool;
+}
+
+/*
+ * LZ4F_compressFrame() と同じ出力を、与えられた圧縮コンテキストを使って得る。
+ *
+ * prefs は fenc_oneshot_prefs() で調整済みであること。
+ */
+static void *
+aux_LZ4F_compressFrame_nogvl(va_list *vp)
+{
+    LZ4F_compressionContext_t cctx = va_arg(*vp, LZ4F_compressionContext_t);
+    const LZ4F_CDict *cdict = va_arg(*vp, const LZ4F_CDict *);
+    char *dest = va_arg(*vp, char *);
+    size_t destsize = va_arg(*vp, size_t);
+    const char *src = va_arg(*vp, const char *);
+    size_t srcsize = va_arg(*vp, size_t);
+    const LZ4F_preferences_t *prefs = va_arg(*vp, const LZ4F_preferences_t *);
+
+    size_t size = 0;
+    size_t s = LZ4F_compressBegin_usingCDict(cctx, dest, destsize, cdict, prefs);
+    if (LZ4F_isError(s)) { return (void *)s; }
+    size += s;
+    s = LZ4F_compressUpdate(cctx, dest + size, destsize - size, src, srcsize, NULL);
+    if (LZ4F_isError(s)) { return (void *)s; }
+    size += s;
+    s = LZ4F_compressEnd(cctx, dest + size, destsize - size, NULL);
+    if (LZ4F_isError(s)) { return (void *)s; }
+    size += s;
+
+    return (void *)size;
+}
+
+/*
+ * LZ4F_compressFrame() が行うのと同じように、src の長さに合わせて設定を調整する。
+ */
+static void
+fenc_oneshot_prefs(LZ4F_preferences_t *prefs, size_t srcsize)
+{
+    LZ4F_blockSizeID_t reqid = (prefs->frameInfo.blockSizeID == LZ4F_default) ? LZ4F_max64KB : prefs->frameInfo.blockSizeID;
+    LZ4F_blockSizeID_t id = LZ4F_max64KB;
+    size_t maxsize = 64 * 1024;
+    while (id < reqid && srcsize > maxsize) {
+        id ++;
+        maxsize <<= 2;
+    }
+    prefs->frameInfo.blockSizeID = id;
+    prefs->frameInfo.contentSize = srcsize;
+    prefs->autoFlush = 1;
+    if (srcsize <= maxsize) {
+        prefs->frameInfo.blockMode = LZ4F_blockIndependent; /* ブロックが一つだけなので連結は不要 */
+    }
+}
+
+/*
+ * call-seq:
+ *  encode(src, level = 1, blocksize: nil, blocklink: false, checksum: true, threads: nil, dictionary: nil) -> lz4 frame'd data
+ *
+ * 文字列 src を一度に圧縮して、LZ4 フレームとしての文字列を返します。
+ *
+ * 出力バッファは LZ4F_compressFrameBound() によって一度だけ確保され、
+ * GVL を手放した状態で LZ4F_compressFrame() 相当の処理が行われます。
+ *
+ * 圧縮コンテキストはスレッドごとに保持され、呼び出しの間で再利用されます。
+ *
+ * フレームヘッダには src の長さが記録されます。
+ *
+ * 引数の意味は LZ4::Encoder.new と同じです。
+ */
+static VALUE
+fenc_s_encode(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, level, opts;
+    rb_scan_args(argc, argv, "11:", &src, &level, &opts);
+    rb_check_type(src, RUBY_T_STRING);
+    VALUE enc = fenc_alloc(mod);
+    struct encoder *p = getencoder(enc);
+    fenc_init_args_prefs(level, opts, p);
+    p->adaptive = 0; /* 出力先が文字列なので意味がない */
+
+    const char *srcp;
+    size_t srcsize;
+    RSTRING_GETMEM(src, srcp, srcsize);
+    fenc_oneshot_prefs(&p->prefs, srcsize);
+
+    if ((p->threads > 1 || p->skip_incompressible || p->index || p->deadline > 0) && p->prefs.frameInfo.blockMode == LZ4F_blockIndependent) {
+        VALUE dest = rb_str_buf_new(0);
+        fenc_setup(p, dest);
+        fenc_update(p, src, NULL);
+        fenc_close(enc);
+        return dest;
+    }
+
+    VALUE pool = aux_cctx_pool();
+    LZ4F_compressionContext_t cctx = ((struct cctx_pool *)getref(pool, &cctx_pool_type))->cctx;
+    size_t destsize = LZ4F_compressFrameBound(srcsize, &p->prefs);
+    VALUE dest = rb_str_buf_new(destsize);
+    size_t size = (size_t)aux_thread_call_without_gvl(aux_LZ4F_compressFrame_nogvl, NULL,
+            cctx, p->cdict, RSTRING_PTR(dest), destsize, srcp, srcsize, &p->prefs);
+    aux_lz4f_check_error(size);
+    rb_str_set_len(dest, size);
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(pool);
+    RB_GC_GUARD(enc);
+
+    return dest;
+}
+
+static VALUE
+fenc_getoutport(VALUE enc)
+{
+    return getencoder(enc)->outport;
+}
+
+static VALUE
+fenc_setoutport(VALUE enc, VALUE outport)
+{
+    fenc_set_outport(getencoder(enc), outport);
+    return outport;
+}
+
+static VALUE
+fenc_dictionary(VALUE enc)
+{
+    return getencoder(enc)->dictionary;
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * 圧縮器の統計情報をハッシュとして返します。値は #reset を跨いで累積されます。
+ *
+ * [bytes_in]       圧縮器に与えられたバイト数
+ * [bytes_out]      outport へ出力したバイト数
+ * [blocks]         出力したブロック数
+ * [stored_blocks]  圧縮されずに格納されたブロック数
+ * [fallback_blocks] deadline: により圧縮レベルを下げて圧縮したブロック数
+ * [compress_time]  圧縮処理に費やした秒数
+ * [output_time]    outport への出力に費やした秒数
+ */
+static VALUE
+fenc_stats(VALUE enc)
+{
+    struct encoder *p = getencoder(enc);
+    VALUE h = aux_stats_to_hash(&p->stats, "compress_time", "output_time");
+    rb_hash_aset(h, ID2SYM(rb_intern("fallback_blocks")), ULL2NUM(p->stats.fallback_blocks));
+    return h;
+}
+
+static int
+fenc_level(struct encoder *p)
+{
+    if (p->adaptive && p->manual) {
+        return aux_frame_level(&p->blockprefs);
+    } else {
+        return aux_frame_level(&p->prefs);
+    }
+}
+
+static VALUE
+fenc_prefs_level(VALUE enc)
+{
+    return INT2NUM(fenc_level(getencoder(enc)));
+}
+
+static VALUE
+fenc_prefs_blocksize(VALUE enc)
+{
+    return INT2NUM(aux_frame_blocksize(&getencoder(enc)->prefs.frameInfo));
+}
+
+static VALUE
+fenc_prefs_blocklink(VALUE enc)
+{
+    return aux_frame_blocklink(&getencoder(enc)->prefs.frameInfo) ? Qtrue : Qfalse;
+}
+
+static VALUE
+fenc_prefs_checksum(VALUE enc)
+{
+    return aux_frame_checksum(&getencoder(enc)->prefs.frameInfo) ? Qtrue : Qfalse;
+}
+
+static VALUE
+fenc_inspect(VALUE enc)
+{
+    struct encoder *p = getencoderp(enc);
+    if (p) {
+        return rb_sprintf("#<%s:%p outport=#<%s:%p>, level=%d, blocksize=%d, blocklink=%s, checksum=%s>",
+                rb_obj_classname(enc), (void *)enc,
+                rb_obj_classname(p->outport), (void *)p->outport,
+                fenc_level(p), aux_frame_blocksize(&p->prefs.frameInfo),
+                aux_frame_blocklink(&p->prefs.frameInfo) ? "true" : "false",
+                aux_frame_checksum(&p->prefs.frameInfo) ? "true" : "false");
+    } else {
+        return rb_sprintf("#<%s:%p **INVALID REFERENCE**>",
+                rb_obj_classname(enc), (void *)enc);
+    }
+}
+
+/*** class LZ4::Decoder ***/
+
+struct decoder
+{
+    VALUE inport;
+    VALUE readbuf;  /* read buffer from inport */
+    VALUE inbuf;    /* staging buffer for LZ4F_decompress */
+    size_t inoff;   /* consumed offset in inbuf */
+    VALUE outbuf;
+    size_t outoff;  /* offset in outbuf */
+    size_t status;  /* status code of LZ4F_decompress */
+    LZ4F_frameInfo_t info;
+    LZ4F_decompressionContext_t decoder;
+    VALUE dictionary;   /* LZ4::Dictionary or nil */
+    const char *dict;
+    size_t dictsize;
+    int indirect;       /* 真であれば inport のファイル記述子から直接読み込む */
+    int concat;         /* 真であれば連結されたフレームを続けて展開する */
+    int nextframe;      /* 真であればフレームの終端に達しており、続くフレームを確認していない */
+    struct aux_stats stats;
+
+    /*
+     * LZ4::Decoder.open で開かれた場合の入力データ。
+     *
+     * mmap が利用できない環境や LZ4::Decoder.decode では、入力データを保持する文字列 mapsrc を指す。
+     */
+    const char *mapped;
+    size_t mapsize;
+    size_t mapoff;
+    VALUE mapsrc;
+
+    /*
+     * 独立ブロックのフレームを複数のスレッドで展開する場合に用いる。
+     */
+    int threads;
+    int manual;         /* 真であれば LZ4F を介さずにブロックを展開する */
+    uint64_t framestart;    /* 現在のフレームの開始時点での stats.bytes_out */
+
+    struct fdec_index *index;   /* シーク用索引 (最初のシークで読み込む) */
+    uint64_t inread;    /* fdec_input で inport から読み込んだバイト数 */
+    uint64_t firstframe;    /* 最初のフレームヘッダの、読み込みを始めた位置からの距離 */
+    uint64_t pos;       /* 展開後のデータにおける現在位置 */
+    int seeked;         /* 真であれば現在のフレームの途中へシークしている */
+    VALUE blockbuf;     /* 読み込んだブロックの保持 */
+    size_t blocktake;   /* blockbuf のうち、現在の展開で取り込んだ位置 */
+    size_t skipleft;    /* 読み飛ばし中のスキップ可能フレームの残り */
+    XXH32_state_t checksum;
+};
+
+static void
+decoder_mark(void *pp)
+{
+    struct decoder *p = pp;
+    rb_gc_mark(p->inport);
+    rb_gc_mark(p->readbuf);
+    rb_gc_mark(p->inbuf);
+    rb_gc_mark(p->outbuf);
+    rb_gc_mark(p->dictionary);
+    rb_gc_mark(p->mapsrc);
+    rb_gc_mark(p->blockbuf);
+}
+
+struct fdec_index;
+static void fdec_index_free(struct fdec_index *idx);
+
+static void
+fdec_unmap(struct decoder *p)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (p->mapped && NIL_P(p->mapsrc)) {
+        munmap((void *)p->mapped, p->mapsize);
+    }
+#endif
+    p->mapped = NULL;
+    p->mapsize = p->mapoff = 0;
+    p->mapsrc = Qnil;
+}
+
+static void
+decoder_free(void *pp)
+{
+    struct decoder *p = pp;
+    fdec_unmap(p);
+    fdec_index_free(p->index);
+    if (p->decoder) {
+        LZ4F_freeDecompressionContext(p->decoder);
+    }
+    memset(p, 0, sizeof(*p));
+    xfree(p);
+}
+
+static const rb_data_type_t decoder_type = {
+    .wrap_struct_name = "extlz4.LZ4.Decoder",
+    .function.dmark = decoder_mark,
+    .function.dfree = decoder_free,
+    /* .function.dsize = decoder_size, */
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+fdec_alloc(VALUE mod)
+{
+    struct decoder *p;
+    VALUE obj = TypedData_Make_Struct(mod, struct decoder, &decoder_type, p);
+    p->inport = Qnil;
+    p->readbuf = Qnil;
+    p->inbuf = Qnil;
+    p->outbuf = Qnil;
+    p->dictionary = Qnil;
+    p->mapsrc = Qnil;
+    p->blockbuf = Qnil;
+    p->outoff = 0;
+    p->status = 0;
+    p->threads = 1;
+    p->concat = 0;
+    return obj;
+}
+
+static struct decoder *
+getdecoderp(VALUE dec)
+{
+    return getrefp(dec, &decoder_type);
+}
+
+static struct decoder *
+getdecoder(VALUE dec)
+{
+    return getref(dec, &decoder_type);
+}
+
+static inline VALUE
+aux_read(VALUE obj, size_t size, VALUE buf)
+{
+    if (NIL_P(buf) || RB_OBJ_FROZEN(buf)) {
+        buf = rb_str_buf_new(size);
+    }
+
+    if (NIL_P(AUX_FUNCALL(obj, id_read, SIZET2NUM(size), buf))) {
+        return Qnil;
+    } else {
+        if ((size_t)RSTRING_LEN(buf) > size) {
+            rb_raise(rb_eRuntimeError, "most read (%d, but expected to %d)", (int)RSTRING_LEN(buf), (int)size);
+        }
+        return buf;
+    }
+}
+
+/*
+ * inport から size バイトを読み込んで buf の末尾に追加する。
+ *
+ * 戻り値が size より小さければ EOF に到達している。
+ *
+ * inport がファイル記述子を直接扱える IO であれば、
+ * IO の読み込みバッファが空である限り GVL を手放して read(2) で直接 buf へ読み込む。
+ *
+ * 読み込みに要した時間を統計情報に加える。
+ */
+static size_t
+fdec_input(struct decoder *p, VALUE buf, size_t size)
+{
+    double t = aux_clock_now();
+    size_t total = 0;
+
+    aux_str_reserve(buf, RSTRING_LEN(buf) + size);
+
+    if (p->mapped) {
+        total = p->mapsize - p->mapoff;
+        if (total > size) { total = size; }
+        memcpy(RSTRING_END(buf), p->mapped + p->mapoff, total);
+        rb_str_set_len(buf, RSTRING_LEN(buf) + total);
+        p->mapoff += total;
+        p->stats.io_time += aux_clock_now() - t;
+        return total;
+    }
+
+    while (total < size) {
+        size_t s;
+        if (p->indirect && !aux_io_read_pending_p(p->inport)) {
+            s = aux_io_read_direct(p->inport, RSTRING_END(buf), size - total);
+        } else if (RSTRING_LEN(buf) == 0) {
+            /* buf が空であれば、inport の read メソッドに直接読み込ませる */
+            VALUE v = aux_read(p->inport, size, buf);
+            if (NIL_P(v)) {
+                rb_str_set_len(buf, 0);
+                break;
+            }
+            s = RSTRING_LEN(v);
+            aux_str_reserve(buf, size);
+            if (s == 0) {
+                break;
+            }
+            total += s;
+            p->inread += s;
+            continue;
+        } else {
+            p->readbuf = aux_read(p->inport, size - total, p->readbuf);
+            if (NIL_P(p->readbuf)) {
+                s = 0;
+            } else {
+                rb_check_type(p->readbuf, RUBY_T_STRING);
+                s = RSTRING_LEN(p->readbuf);
+                memcpy(RSTRING_END(buf), RSTRING_PTR(p->readbuf), s);
+            }
+        }
+
+        if (s == 0) {
+            break;
+        }
+
+        rb_str_set_len(buf, RSTRING_LEN(buf) + s);
+        total += s;
+        p->inread += s;
+    }
+
+    p->stats.io_time += aux_clock_now() - t;
+
+    return total;
+}
+
+static int
+fdec_blocksize(struct decoder *p)
+{
+    return aux_frame_blocksize(&p->info);
+}
+
+static void
+fdec_init_opts(struct decoder *p, VALUE opts)
+{
+    if (!NIL_P(opts)) {
+        VALUE threads, concat;
+        RBX_SCANHASH(opts, Qnil,
+                RBX_SCANHASH_ARGS("dictionary", &p->dictionary, Qnil),
+                RBX_SCANHASH_ARGS("threads", &threads, Qnil),
+                RBX_SCANHASH_ARGS("concat", &concat, Qfalse));
+        p->threads = aux_threads(threads);
+        p->concat = RTEST(concat);
+        struct dictionary *dic = aux_dictionary(p->dictionary);
+        if (dic) {
+            RSTRING_GETMEM(dic->data, p->dict, p->dictsize);
+        }
+    }
+}
+
+static void
+fdec_raise_eof(struct decoder *p)
+{
+    if (p->mapped && p->mapsrc != p->inport) {
+        rb_raise(rb_eRuntimeError,
+                "unexpected EOF (truncated file) - %"PRIsVALUE, p->inport);
+    } else {
+        rb_raise(rb_eRuntimeError,
+                "unexpected EOF (read error) - #<%s:%p>",
+                rb_obj_classname(p->inport), (const void *)p->inport);
+    }
+}
+
+/*
+ * 入力から skipleft バイトを読み飛ばす。
+ *
+ * 割り込みで中断された場合は、次の呼び出しで残りを読み飛ばす。
+ */
+static void
+fdec_skip(struct decoder *p)
+{
+    if (p->mapped) {
+        if (p->mapsize - p->mapoff < p->skipleft) {
+            fdec_raise_eof(p);
+        }
+        p->mapoff += p->skipleft;
+        p->skipleft = 0;
+        return;
+    }
+
+    while (p->skipleft > 0) {
+        /* 中断された読み込みで inbuf に取り込まれたデータも読み飛ばした分に数える */
+        size_t s = (p->skipleft < WORK_BUFFER_SIZE) ? p->skipleft : WORK_BUFFER_SIZE;
+        if (RSTRING_LEN(p->inbuf) == 0 && fdec_input(p, p->inbuf, s) == 0) {
+            fdec_raise_eof(p);
+        }
+        p->skipleft -= RSTRING_LEN(p->inbuf);
+        rb_str_set_len(p->inbuf, 0);
+    }
+}
+
+/*
+ * 次のフレームヘッダを読み込んで LZ4F に与える。
+ *
+ * スキップ可能フレームは読み飛ばす。
+ *
+ * first が偽であり、フレームヘッダの前に入力の終端に達した場合は 0 を返す。
+ */
+static int
+fdec_read_header(struct decoder *p, int first)
+{
+    VALUE inport = p->inport;
+    size_t zero = 0;
+
+    for (;;) {
+        /*
+         * 割り込みで中断された読み込みを再開する。
+         * フレームの終端では inbuf は空になっているため、残っているのは読みかけのヘッダである。
+         */
+        if (p->skipleft > 0) {
+            fdec_skip(p);
+        }
+        p->inoff = 0;
+
+        size_t s = LZ4F_MIN_SIZE_TO_KNOW_HEADER_LENGTH;
+        int i;
+        for (i = 0; i < 2; i ++) {
+            /*
+             * first step: read magic number and frame descriptor flags
+             * second step: read rest of frame header
+             */
+            size_t have = RSTRING_LEN(p->inbuf);
+            size_t n = (have < s) ? fdec_input(p, p->inbuf, s - have) : 0;
+            if (n == 0 && have == 0 && i == 0 && !first) {
+                return 0;
+            }
+            if (have + n < s) {
+                rb_raise(extlz4_eError,
+                         "unexpected EOF (read error) - #<%s:%p>",
+                         rb_obj_classname(inport), (const void *)inport);
+            }
+            if (i == 0) {
+                s = LZ4F_headerSize(RSTRING_PTR(p->inbuf), RSTRING_LEN(p->inbuf));
+                aux_lz4f_check_error(s);
+                if (s > AUX_LZ4FRAME_HEADER_MAX) {
+                    aux_lz4f_check_error((size_t)-LZ4F_ERROR_frameHeader_incomplete);
+                }
+            }
+        }
+
+        if ((aux_read_le32(RSTRING_PTR(p->inbuf)) & 0xfffffff0U) == AUX_LZ4F_MAGIC_SKIPPABLE_START) {
+            size_t size = aux_read_le32(RSTRING_PTR(p->inbuf) + 4);
+            p->stats.bytes_in += RSTRING_LEN(p->inbuf) + size;
+            rb_str_set_len(p->inbuf, 0);
+            p->skipleft = size;
+            fdec_skip(p);
+            continue;
+        }
+
+        size_t headersize = RSTRING_LEN(p->inbuf);
+        if (first) {
+            p->firstframe = p->stats.bytes_in;
+        }
+        if (p->manual || p->status != 0) {
+            /*
+             * LZ4F が終端まで展開していないフレームの状態 (内容の長さの残りなど) は
+             * LZ4F_resetDecompressionContext() では消えないため作り直す。
+             */
+            LZ4F_freeDecompressionContext(p->decoder);
+            p->decoder = NULL;
+            aux_lz4f_check_error(LZ4F_createDecompressionContext(&p->decoder, LZ4F_VERSION));
+        } else {
+            LZ4F_resetDecompressionContext(p->decoder);
+        }
+        /* 辞書は LZ4F の展開状態が初期状態の時にのみ設定されるため、ここで与えておく */
+        s = aux_LZ4F_decompress(p->decoder, NULL, &zero, RSTRING_PTR(p->inbuf), &headersize, p->dict, p->dictsize);
+        aux_lz4f_check_error(s);
+        rb_str_set_len(p->inbuf, 0);
+        p->status = s;
+        p->stats.bytes_in += headersize;
+
+        return 1;
+    }
+}
+
+/*
+ * フレームヘッダを読み込んだ後の、フレームごとの準備を行う。
+ */
+static void
+fdec_begin_frame(struct decoder *p)
+{
+    VALUE inport = p->inport;
+    size_t zero = 0;
+    size_t s = LZ4F_getFrameInfo(p->decoder, &p->info, NULL, &zero);
+    aux_lz4f_check_error(s);
+    p->framestart = p->stats.bytes_out;
+    p->seeked = 0;
+    aux_stats_begin(&p->stats, 0, p->info.blockChecksumFlag == LZ4F_blockChecksumEnabled);
+    if (p->info.dictID != 0) {
+        struct dictionary *dic = aux_dictionary(p->dictionary);
+        if (!dic || (dic->id != 0 && dic->id != p->info.dictID)) {
+            rb_raise(extlz4_eError,
+                     "wrong dictionary given (frame requires dictid=%u) - #<%s:%p>",
+                     (unsigned int)p->info.dictID,
+                     rb_obj_classname(inport), (const void *)inport);
+        }
+    }
+
+    if (p->threads > 1 && p->info.blockMode == LZ4F_blockIndependent) {
+        p->manual = 1;
+        XXH32_reset(&p->checksum, 0);
+        if (!p->mapped && NIL_P(p->blockbuf)) {
+            p->blockbuf = rb_str_buf_new(0);
+        }
+    } else {
+        p->manual = 0;
+    }
+
+    /*
+     * 前のフレームの展開済みデータは読み終わっている。
+     *
+     * 一時バッファの領域は fdec_read_fetch で初めて必要になった時に確保する。
+     * LZ4::Decoder.decode のように直接展開するだけであれば確保しない。
+     */
+    if (NIL_P(p->outbuf)) {
+        p->outbuf = rb_str_tmp_new(0);
+    }
+    rb_str_set_len(p->outbuf, 0);
+    p->outoff = 0;
+}
+
+/*
+ * 最初のフレームヘッダを読み込んで展開の準備を行う。
+ */
+static void
+fdec_setup(struct decoder *p)
+{
+    LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&p->decoder, LZ4F_VERSION);
+    aux_lz4f_check_error(err);
+    p->readbuf = rb_str_buf_new(0);
+    /* inport の read メソッドへ直接渡すことがあるため、不可視オブジェクトにしない */
+    p->inbuf = rb_str_buf_new(AUX_LZ4FRAME_HEADER_MAX);
+    fdec_read_header(p, 1);
+    fdec_begin_frame(p);
+    rb_thread_check_ints();
+}
+
+/*
+ * フレームの終端に達した後、続くフレームがあれば展開の準備を行う。
+ */
+static void
+fdec_next_frame(struct decoder *p)
+{
+    /* ヘッダの読み込みが中断された場合は、次の呼び出しで再開する */
+    int found = fdec_read_header(p, 0);
+    p->nextframe = 0;
+    if (found) {
+        fdec_begin_frame(p);
+    }
+    rb_thread_check_ints();
+}
+
+/*
+ * call-seq:
+ *  initialize(inport, dictionary: nil, threads: nil, concat: false) -> self
+ *
+ * [inport]
+ *  An I/O (liked) object for data read from LZ4 Frame.
+ *
+ *  This object need +.read+ method.
+ *
+ *  IO#read を再定義していないバイナリモードの IO であれば、
+ *  ruby のメソッドを経由せずにファイル記述子から直接読み込みます。
+ *
+ * [dictionary: nil (LZ4::Dictionary)]
+ *  圧縮時に用いられた事前辞書を指定します。
+ *
+ * [threads: nil (Integer)]
+ *  ブロックを展開するネイティブスレッドの数を指定します。
+ *
+ *  2 以上を与えた場合、独立ブロックのフレーム (圧縮時に blocklink: false) であれば
+ *  threads 個のブロックを先読みし、GVL を手放して並列に展開します。
+ *  ブロックが連結されたフレームでは無視されます。
+ *
+ * [concat: false]
+ *  真であれば、フレームの終端に続くフレームを一続きのデータとして展開します。
+ *  スキップ可能フレーム (skippable frame) は読み飛ばされます。
+ *  追記を繰り返したログファイルなど、フレームが連結された入力に用います。
+ *
+ *  偽であれば最初のフレームの終端で展開を終え、それ以降の入力は読み込みません。
+ *  プロトコルやコンテナに埋め込まれたフレームのように、続くデータは呼び出し元が扱います。
+ *  先頭のスキップ可能フレームは、どちらの場合も読み飛ばされます。
+ */
+static VALUE
+fdec_init(int argc, VALUE argv[], VALUE dec)
+{
+    struct decoder *p = getdecoder(dec);
+    VALUE inport, opts;
+    //VALUE readblocksize;
+    rb_scan_args(argc, argv, "1:", &inport, &opts);
+    fdec_init_opts(p, opts);
+    p->inport = inport;
+    p->indirect = aux_io_direct_readable_p(inport);
+    fdec_setup(p);
+
+    return dec;
+}
+
+static VALUE fdec_close(VALUE dec);
+
+/*
+ * path のファイルを読み込み専用でメモリに割り当てる。
+ */
+static void
+fdec_map(struct decoder *p, VALUE path)
+{
+#ifdef HAVE_SYS_MMAN_H
+    int fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0);
+    if (fd < 0) {
+        rb_sys_fail_str(path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        rb_syserr_fail_str(err, path);
+    }
+
+    if (st.st_size > 0) {
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            rb_syserr_fail_str(err, path);
+        }
+# ifdef MADV_SEQUENTIAL
+        madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+# endif
+        p->mapped = m;
+        p->mapsize = (size_t)st.st_size;
+    }
+    close(fd);
+#else
+    VALUE src = rb_funcall2(rb_cFile, rb_intern("binread"), 1, &path);
+    rb_check_type(src, RUBY_T_STRING);
+    p->mapsrc = rb_str_freeze(src);
+    RSTRING_GETMEM(p->mapsrc, p->mapped, p->mapsize);
+#endif
+    p->mapoff = 0;
+}
+
+/*
+ * call-seq:
+ *  open(path, dictionary: nil, threads: nil, concat: false) -> decoder
+ *  open(path, dictionary: nil, threads: nil, concat: false) { |decoder| ... } -> yield returned value
+ *
+ * path で示される LZ4 フレームのファイルをメモリに割り当て (mmap) て展開器を作成します。
+ *
+ * 圧縮データは割り当てられたメモリから直接 LZ4F_decompress() に渡されるため、
+ * 読み込みと複製の処理が省かれます。
+ *
+ * ブロックを与えた場合、ブロックを抜けた時点で展開器は閉じられます。
+ */
+static VALUE
+fdec_s_open(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE path, opts;
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    FilePathValue(path);
+    path = rb_str_new_frozen(path);
+    VALUE dec = fdec_alloc(mod);
+    struct decoder *p = getdecoder(dec);
+    fdec_init_opts(p, opts);
+    p->inport = path;
+    fdec_map(p, rb_str_encode_ospath(path));
+    fdec_setup(p);
+
+    if (rb_block_given_p()) {
+        return rb_ensure(rb_yield, dec, fdec_close, dec);
+    } else {
+        return dec;
+    }
+}
+
+static inline void
+fdec_read_args(int argc, VALUE argv[], size_t *size, VALUE *buf)
+{
+    switch (argc) {
+    case 0:
+        *size = ~(size_t)0;
+        *buf = rb_str_buf_new(0);
+        break;
+    case 1:
+        *size = NUM2SIZET(argv[0]);
+        *buf = rb_str_buf_new(*size);
+        break;
+    case 2:
+        *size = NUM2SIZET(argv[0]);
+        *buf = argv[1];
+        rb_check_type(*buf, RUBY_T_STRING);
+        aux_str_reserve(*buf, *size);
+        rb_str_set_len(*buf, 0);
+        break;
+    default:
+        rb_error_arity(argc, 0, 2);
+    }
+}
+
+struct fdec_block
+{
+    size_t off;         /* 読み込んだデータの先頭からのブロックデータの位置 */
+    const char *src;
+    size_t srcsize;
+    int stored;
+    char *dest;
+    size_t size;        /* 展開されたバイト数、または LZ4F のエラーコード */
+};
+
+struct fdec_blocks
+{
+    struct decoder *decoder;
+    struct fdec_block *blocks;
+    size_t nblocks;
+    size_t size;        /* 詰め直した後の展開されたバイト数、または LZ4F のエラーコード */
+};
+
+static void
+fdec_blocks_decode_block(void *arg, size_t index, int worker)
+{
+    struct fdec_blocks *b = arg;
+    struct decoder *p = b->decoder;
+    struct fdec_block *blk = &b->blocks[index];
+    const size_t blocksize = fdec_blocksize(p);
+
+    (void)worker;
+
+    if (p->info.blockChecksumFlag == LZ4F_blockChecksumEnabled &&
+            XXH32(blk->src, blk->srcsize, 0) != aux_read_le32(blk->src + blk->srcsize)) {
+        blk->size = (size_t)-LZ4F_ERROR_blockChecksum_invalid;
+    } else if (blk->stored) {
+        memcpy(blk->dest, blk->src, blk->srcsize);
+        blk->size = blk->srcsize;
+    } else {
+        int s = LZ4_decompress_safe_usingDict(blk->src, blk->dest,
+                (int)blk->srcsize, (int)blocksize, p->dict, (int)p->dictsize);
+        blk->size = (s < 0) ? (size_t)-LZ4F_ERROR_decompressionFailed : (size_t)s;
+    }
+}
+
+static void *
+fdec_blocks_decode_nogvl(va_list *vp)
+{
+    struct fdec_blocks *b = va_arg(*vp, struct fdec_blocks *);
+    struct decoder *p = b->decoder;
+    char *destp = b->blocks[0].dest;
+    size_t i;
+
+    extlz4_parallel_run(p->threads, b->nblocks, fdec_blocks_decode_block, b);
+
+    b->size = 0;
+    for (i = 0; i < b->nblocks; i ++) {
+        if (LZ4F_isError(b->blocks[i].size)) {
+            b->size = b->blocks[i].size;
+            break;
+        }
+        memmove(destp + b->size, b->blocks[i].dest, b->blocks[i].size);
+        if (p->info.contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+            XXH32_update(&p->checksum, destp + b->size, b->blocks[i].size);
+        }
+        b->size += b->blocks[i].size;
+    }
+
+    return NULL;
+}
+
+/*
+ * 入力から size バイトを取り込み、取り込んだデータの位置を返す。
+ *
+ * 位置は割り当てられたメモリの先頭、あるいは blockbuf の先頭からのバイト数。
+ */
+static size_t
+fdec_take_manual(struct decoder *p, size_t size)
+{
+    size_t off;
+
+    if (p->mapped) {
+        off = p->mapoff;
+        if (p->mapsize - off < size) {
+            fdec_raise_eof(p);
+        }
+        p->mapoff += size;
+    } else {
+        /* 割り込みで中断された展開の読み込み済みのデータは blockbuf に残っている */
+        off = p->blocktake;
+        size_t have = RSTRING_LEN(p->blockbuf) - off;
+        if (have < size && fdec_input(p, p->blockbuf, size - have) < size - have) {
+            fdec_raise_eof(p);
+        }
+        p->blocktake += size;
+    }
+
+    return off;
+}
+
+/*
+ * 最大 threads 個のブロックを読み込んで outp へ並列に展開し、展開したバイト数を返す。
+ *
+ * outp は少なくともブロックの最大長 (blocksize) の大きさが必要。
+ * 展開するブロックの数は outsize に収まる数に制限される。
+ *
+ * フレームの終端に達した場合は内容のチェックサムを検証して status を 0 にする。
+ */
+static size_t
+fdec_fetch_manual(struct decoder *p, char *outp, size_t outsize)
+{
+    const size_t blocksize = fdec_blocksize(p);
+    const size_t blocksum = (p->info.blockChecksumFlag == LZ4F_blockChecksumEnabled) ? 4 : 0;
+    size_t nmax = outsize / blocksize;
+    if (nmax > (size_t)p->threads) { nmax = p->threads; }
+    struct fdec_block blocks[p->threads];
+    size_t n = 0, endoff = 0, i;
+    int ended = 0;
+
+    p->blocktake = 0;
+    const size_t head = p->mapped ? p->mapoff : 0;
+
+    while (n < nmax) {
+        size_t off = fdec_take_manual(p, 4);
+        const char *base = p->mapped ? p->mapped : RSTRING_PTR(p->blockbuf);
+        uint32_t h = aux_read_le32(base + off);
+        if (h == 0) {
+            ended = 1;
+            if (p->info.contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+                endoff = fdec_take_manual(p, 4);
+            }
+            break;
+        }
+
+        size_t size = h & 0x7fffffff;
+        if (size > blocksize) {
+            aux_lz4f_check_error((size_t)-LZ4F_ERROR_maxBlockSize_invalid);
+        }
+        blocks[n ++] = (struct fdec_block){
+            .off = fdec_take_manual(p, size + blocksum),
+            .srcsize = size,
+            .stored = (h & AUX_STORED_BLOCK_FLAG) ? 1 : 0,
+        };
+    }
+
+    /* blockbuf は読み込みのたびに再確保されうるため、ここで位置を確定する */
+    const char *base = p->mapped ? p->mapped : RSTRING_PTR(p->blockbuf);
+    const size_t insize = (p->mapped ? p->mapoff : p->blocktake) - head;
+    for (i = 0; i < n; i ++) {
+        blocks[i].src = base + blocks[i].off;
+        blocks[i].dest = outp + blocksize * i;
+    }
+
+    outsize = 0;
+    if (n > 0) {
+        struct fdec_blocks b = { p, blocks, n, 0 };
+        double t = aux_clock_now();
+        /* 内容のチェックサムと入力の位置を更新し終えるまで割り込みを保留する */
+        void *dummy;
+        while (!aux_thread_try_without_gvl(&dummy, fdec_blocks_decode_nogvl, NULL, &b)) {
+            /*
+             * 展開しなかったブロックは次の呼び出しで改めて取り込む。
+             * blockbuf の内容はそのまま残るため、割り当てられたメモリの位置だけを戻す。
+             */
+            if (p->mapped) { p->mapoff = head; }
+            rb_thread_check_ints();
+            if (p->mapped) { p->mapoff = head + insize; }
+        }
+        p->stats.codec_time += aux_clock_now() - t;
+        aux_lz4f_check_error(b.size);
+        outsize = b.size;
+    }
+
+    p->stats.bytes_in += insize;
+    p->stats.bytes_out += outsize;
+    aux_stats_scan(&p->stats, base + head, insize);
+
+    if (ended && !p->seeked) {
+        if (p->info.contentChecksumFlag == LZ4F_contentChecksumEnabled &&
+                XXH32_digest(&p->checksum) != aux_read_le32(base + endoff)) {
+            aux_lz4f_check_error((size_t)-LZ4F_ERROR_contentChecksum_invalid);
+        }
+        if (p->info.contentSize != 0 && p->info.contentSize != p->stats.bytes_out - p->framestart) {
+            aux_lz4f_check_error((size_t)-LZ4F_ERROR_frameSize_wrong);
+        }
+    }
+
+    if (!p->mapped) {
+        /*
+         * 展開を終えたデータを取り除く。
+         * 中断された前回の呼び出しが今回より多くのブロックを読み込んでいた場合は、その残りを先頭に寄せる。
+         */
+        size_t rest = RSTRING_LEN(p->blockbuf) - p->blocktake;
+        if (rest > 0) {
+            memmove(RSTRING_PTR(p->blockbuf), RSTRING_PTR(p->blockbuf) + p->blocktake, rest);
+        }
+        rb_str_set_len(p->blockbuf, rest);
+        p->blocktake = 0;
+    }
+
+    if (ended) {
+        p->status = 0;
+        p->nextframe = p->concat;
+    }
+
+    return outsize;
+}
+
+/*
+ * 入力を読み込んで outp へ展開し、展開したバイト数を返す。
+ */
+static size_t
+fdec_fetch(struct decoder *p, char *outp, size_t outsize)
+{
+    if (p->manual) {
+        return fdec_fetch_manual(p, outp, outsize);
+    }
+
+    const char *inp;
+    size_t insize;
+
+    if (p->mapped) {
+        /*
+         * 割り当てられたメモリを直接展開する。
+         *
+         * 入力を LZ4F の要求する長さ (status) に制限しないと、出力先の空きが少ない時に
+         * 次のブロックまで LZ4F 内部の一時バッファに展開されて複製が生じる。
+         */
+        inp = p->mapped + p->mapoff;
+        insize = p->mapsize - p->mapoff;
+        if (insize < p->status) {
+            fdec_raise_eof(p);
+        }
+        insize = p->status;
+    } else {
+        size_t avail = RSTRING_LEN(p->inbuf) - p->inoff;
+        if (avail < p->status) {
+            size_t need = p->status - avail;
+            if (avail == 0) {
+                rb_str_set_len(p->inbuf, 0);
+                p->inoff = 0;
+            } else if (p->inoff > 0 && rb_str_capacity(p->inbuf) - RSTRING_LEN(p->inbuf) < need) {
+                /* 末尾に収まらない時だけ未消費の部分を先頭に寄せる */
+                memmove(RSTRING_PTR(p->inbuf), RSTRING_PTR(p->inbuf) + p->inoff, avail);
+                rb_str_set_len(p->inbuf, avail);
+                p->inoff = 0;
+            }
+            if (fdec_input(p, p->inbuf, need) < need) {
+                fdec_raise_eof(p);
+            }
+        }
+
+        inp = RSTRING_PTR(p->inbuf) + p->inoff;
+        insize = RSTRING_LEN(p->inbuf) - p->inoff;
+    }
+
+    double t = aux_clock_now();
+    p->status = aux_LZ4F_decompress(p->decoder, outp, &outsize, inp, &insize, p->dict, p->dictsize);
+    p->stats.codec_time += aux_clock_now() - t;
+    aux_lz4f_check_error(p->status);
+    if (p->status == 0) {
+        p->nextframe = p->concat;
+    }
+    p->stats.bytes_in += insize;
+    p->stats.bytes_out += outsize;
+    aux_stats_scan(&p->stats, inp, insize);
+    if (p->mapped) {
+        p->mapoff += insize;
+    } else {
+        p->inoff += insize;
+        if (p->inoff >= (size_t)RSTRING_LEN(p->inbuf)) {
+            rb_str_set_len(p->inbuf, 0);
+            p->inoff = 0;
+        }
+    }
+
+    return outsize;
+}
+
+/*
+ * outbuf へ展開する。保留された割り込みは呼び出し元が処理する。
+ */
+static void
+fdec_fetch_outbuf(struct decoder *p)
+{
+    size_t outsize = fdec_blocksize(p) * (p->manual ? p->threads : 1);
+    if (rb_str_capacity(p->outbuf) < outsize) {
+        /* 展開が中断されても未初期化の内容を返さないように、長さは 0 にしておく */
+        p->outbuf = rb_str_tmp_new(outsize);
+        rb_str_set_len(p->outbuf, 0);
+    }
+    outsize = fdec_fetch(p, RSTRING_PTR(p->outbuf), rb_str_capacity(p->outbuf));
+    rb_str_set_len(p->outbuf, outsize);
+    p->outoff = 0;
+}
+
+static void
+fdec_read_fetch(VALUE dec, struct decoder *p)
+{
+    fdec_fetch_outbuf(p);
+    rb_thread_check_ints();
+}
+
+/*
+ * 入力の終端に達しており、展開済みのデータも残っていなければ真を返す。
+ *
+ * フレームの終端に達していれば、続くフレームがあるかどうかを入力から確認する。
+ */
+static int
+fdec_eof_p(struct decoder *p)
+{
+    if (!NIL_P(p->outbuf) && RSTRING_LEN(p->outbuf) > 0) {
+        return 0;
+    }
+
+    if (p->status == 0 && p->nextframe) {
+        fdec_next_frame(p);
+    }
+
+    return p->status == 0;
+}
+
+static size_t
+fdec_read_decode(VALUE dec, struct decoder *p, char *dest, size_t size)
+{
+    const char *const desthead = dest;
+    uintptr_t desttail = (uintptr_t)dest + size;
+
+    while ((uintptr_t)dest < desttail) {
+        if (fdec_eof_p(p)) {
+            break;
+        }
+
+        if (p->status > 0 && p->outoff >= (size_t)RSTRING_LEN(p->outbuf)) {
+            if (size >= (size_t)fdec_blocksize(p)) {
+                /* 一時バッファを経由せずに直接展開する */
+                size_t s = fdec_fetch(p, dest, size);
+                dest += s;
+                size -= s;
+                p->pos += s;
+                rb_thread_check_ints();
+                continue;
+            }
+
+            fdec_read_fetch(dec, p);
+        }
+
+        if (size < RSTRING_LEN(p->outbuf) - p->outoff) {
+            memcpy(dest, RSTRING_PTR(p->outbuf) + p->outoff, size);
+            p->outoff += size;
+            dest += size;
+            p->pos += size;
+            break;
+        } else {
+            size_t s = RSTRING_LEN(p->outbuf) - p->outoff;
+            memcpy(dest, RSTRING_PTR(p->outbuf) + p->outoff, s);
+            p->outoff = 0;
+            rb_str_set_len(p->outbuf, 0);
+            dest += s;
+            size -= s;
+            p->pos += s;
+        }
+    }
+
+    /* 割り込みで抜けても pos が入力と食い違わないように、p->pos は展開するたびに進める */
+    return dest - desthead;
+}
+
+/*
+ * 残りのすべてを展開して dest に格納する。
+ *
+ * フレームヘッダに内容の長さが記録されていれば、dest をその長さで一度だけ確保して直接展開する。
+ * 記録されていなければ、dest を倍々に拡張しながら直接展開する。
+ *
+ * 一時バッファに未読のデータがなければ、残りがブロック長に満たなくても一時バッファを経由しない。
+ * ただし threads による並列展開はブロック長以上の空きを必要とする。
+ */
+static void
+fdec_read_all(VALUE dec, struct decoder *p, VALUE dest)
+{
+    const size_t blocksize = fdec_blocksize(p);
+    size_t expect = 0;
+
+    if (p->info.contentSize > 0 && p->info.contentSize >= p->stats.bytes_out - p->framestart) {
+        /* 終端マークを読み込ませるため 1 バイト余分に確保する */
+        expect = p->info.contentSize - (p->stats.bytes_out - p->framestart) +
+                 (RSTRING_LEN(p->outbuf) - p->outoff) + 1;
+    }
+
+    /*
+     * 出力先の空きがブロック長に満たないと LZ4F は内部の一時バッファへ展開して複製するため、
+     * 内容が短くてもブロック長は確保しておき、最後に切り詰める。
+     */
+    rb_str_set_len(dest, 0);
+    aux_str_reserve(dest, (expect > blocksize) ? expect : blocksize);
+
+    while (!fdec_eof_p(p)) {
+        size_t len = RSTRING_LEN(dest);
+        size_t room = rb_str_capacity(dest) - len;
+        if (room < 1) {
+            aux_str_reserve(dest, len + (len > blocksize ? len : blocksize));
+            room = rb_str_capacity(dest) - len;
+        }
+        size_t s;
+        if (p->status > 0 && p->outoff >= (size_t)RSTRING_LEN(p->outbuf) &&
+                (!p->manual || room >= blocksize)) {
+            s = fdec_fetch(p, RSTRING_PTR(dest) + len, room);
+            p->pos += s;
+            rb_str_set_len(dest, len + s);
+            rb_thread_check_ints();
+        } else {
+            s = fdec_read_decode(dec, p, RSTRING_PTR(dest) + len, room);
+            rb_str_set_len(dest, len + s);
+        }
+    }
+
+    if (expect > 0 && expect < blocksize) {
+        rb_str_resize(dest, RSTRING_LEN(dest));
+    }
+}
+
+/*
+ * call-seq:
+ *  read -> string
+ *  read(size) -> string
+ *  read(size, buffer) -> buffer
+ *
+ * 読み込む残りの長さがブロックの最大長以上であれば、
+ * 展開器の一時バッファを経由せずに戻り値となる文字列へ直接展開します。
+ *
+ * buffer を繰り返し与えて読み込む場合、size をブロックの最大長
+ * (prefs_blocksize) の倍数にすると複製が最も少なくなります。
+ */
+static VALUE
+fdec_read(int argc, VALUE argv[], VALUE dec)
+{
+    struct decoder *p = getdecoder(dec);
+    size_t size;
+    VALUE dest;
+    fdec_read_args(argc, argv, &size, &dest);
+    if (size == 0) {
+        return dest;
+    }
+
+    if (fdec_eof_p(p)) {
+        return Qnil;
+    }
+
+    if ((ssize_t)size > 0) {
+        char *destp = RSTRING_PTR(dest);
+        size_t destsize = size;
+        destsize = fdec_read_decode(dec, p, destp, destsize);
+        rb_str_set_len(dest, destsize);
+    } else {
+        fdec_read_all(dec, p, dest);
+    }
+
+
+    if (RSTRING_LEN(dest) > 0) {
+        return dest;
+    } else {
+        return Qnil;
+    }
+}
+
+/*
+ * call-seq:
+ *  decode(src, dictionary: nil, threads: nil, concat: false) -> decoded string
+ *
+ * 文字列 src を LZ4 フレームとして展開します。
+ *
+ * src のメモリを直接展開するため、IO や StringIO を介しません。
+ * フレームヘッダに内容の長さが記録されていれば、展開結果の文字列はその長さで一度だけ確保されます。
+ */
+static VALUE
+fdec_s_decode(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "1:", &src, &opts);
+    src = rb_str_new_frozen(StringValue(src));
+    VALUE dec = fdec_alloc(mod);
+    struct decoder *p = getdecoder(dec);
+    fdec_init_opts(p, opts);
+    p->inport = src;
+    p->mapsrc = src;
+    RSTRING_GETMEM(src, p->mapped, p->mapsize);
+    p->mapoff = 0;
+    fdec_setup(p);
+
+    VALUE dest = rb_str_buf_new(0);
+    fdec_read_all(dec, p, dest);
+    fdec_close(dec);
+
+    return dest;
+}
+
+/*
+ * call-seq:
+ *  getc -> String | nil
+ *
+ * Read one byte character.
+ */
+static VALUE
+fdec_getc(VALUE dec)
+{
+    struct decoder *p = getdecoder(dec);
+
+    if (fdec_eof_p(p)) {
+        return Qnil;
+    }
+
+    char ch;
+    size_t s = fdec_read_decode(dec, p, &ch, 1);
+    if (s > 0) {
+        VALUE v = rb_str_new(&ch, 1);
+        return v;
+    } else {
+        return Qnil;
+    }
+}
+
+/*
+ * call-seq:
+ *  getbyte -> Integer | nil
+ *
+ * Read one byte code integer.
+ */
+static VALUE
+fdec_getbyte(VALUE dec)
+{
+    struct decoder *p = getdecoder(dec);
+
+    unsigned char ch;
+    size_t s = fdec_read_decode(dec, p, (char *)&ch, 1);
+    if (s > 0) {
+        return INT2FIX(ch);
+    } else {
+        return Qnil;
+    }
+}
+
+/*
+ * outbuf に未読のデータがなければ展開する。
+ *
+ * 入力の終端に達していれば 0 を返す。
+ */
+static int
+fdec_fill(VALUE dec, struct decoder *p)
+{
+    while (p->outoff >= (size_t)RSTRING_LEN(p->outbuf)) {
+        rb_str_set_len(p->outbuf, 0);
+        p->outoff = 0;
+        if (fdec_eof_p(p)) {
+            return 0;
+        }
+        fdec_read_fetch(dec, p);
+    }
+
+    return 1;
+}
+
+/*
+ * outbuf の未読部分の先頭 size バイトを line に追加して読み進める。
+ */
+static VALUE
+fdec_take(struct decoder *p, VALUE line, size_t size)
+{
+    const char *head = RSTRING_PTR(p->outbuf) + p->outoff;
+    if (NIL_P(line)) {
+        line = rb_str_new(head, size);
+    } else {
+        rb_str_buf_cat(line, head, size);
+    }
+    p->outoff += size;
+    p->pos += size;
+    return line;
+}
+
+/*
+ * outbuf の未読部分の先頭から続く ch を読み飛ばす。
+ */
+static void
+fdec_swallow(VALUE dec, struct decoder *p, char ch)
+{
+    while (fdec_fill(dec, p)) {
+        const char *head = RSTRING_PTR(p->outbuf) + p->outoff;
+        size_t avail = RSTRING_LEN(p->outbuf) - p->outoff;
+        size_t n;
+        for (n = 0; n < avail && head[n] == ch; n ++) { }
+        p->outoff += n;
+        p->pos += n;
+        if (n < avail) {
+            break;
+        }
+    }
+}
+
+/*
+ * 区切り sep を含む次の行を返す。終端に達していれば nil を返す。
+ * 行が limit バイトに達した場合は、区切りの途中であってもそこまでを返す。
+ *
+ * outbuf から memchr で区切りを探して切り出すため、ruby の世界を 1 バイトずつ経由しない。
+ * 複数バイトの区切りが outbuf の境界をまたぐ場合にも対応する。
+ * seplen が 0 であれば区切りを探さず、limit バイトまでを返す。
+ */
+static VALUE
+fdec_gets_sep(VALUE dec, struct decoder *p, const char *sep, size_t seplen, size_t limit, int chomp)
+{
+    VALUE line = Qnil;
+
+    while (fdec_fill(dec, p)) {
+        const char *head = RSTRING_PTR(p->outbuf) + p->outoff;
+        size_t avail = RSTRING_LEN(p->outbuf) - p->outoff;
+        size_t linelen = NIL_P(line) ? 0 : RSTRING_LEN(line);
+        if (avail > limit - linelen) {
+            avail = limit - linelen;
+        }
+
+        /*
+         * 行末が sep の先頭 k バイトと一致していれば、区切りが outbuf の境界をまたいでいる。
+         * より手前から始まる区切りを優先するため、長い k から確かめる。
+         * 区切りの残りが avail に収まらなければ、行末を部分一致のまま次の outbuf へ持ち越す。
+         */
+        if (seplen > 1 && linelen > 0) {
+            size_t k = (linelen < seplen - 1) ? linelen : seplen - 1;
+            for (; k > 0; k --) {
+                size_t rest = seplen - k;
+                size_t n = (rest < avail) ? rest : avail;
+                if (memcmp(RSTRING_END(line) - k, sep, k) == 0 && memcmp(head, sep + k, n) == 0) {
+                    if (n == rest) {
+                        line = fdec_take(p, line, rest);
+                        goto found;
+                    }
+                    goto partial;
+                }
+            }
+        }
+
+        if (seplen > 0) {
+            const char *q = head;
+            const char *tail = head + avail;
+            while ((q = memchr(q, sep[0], tail - q)) != NULL) {
+                if ((size_t)(tail - q) < seplen) {
+                    break; /* 残りは次の outbuf と合わせて確かめる */
+                }
+                if (memcmp(q, sep, seplen) == 0) {
+                    line = fdec_take(p, line, q + seplen - head);
+                    goto found;
+                }
+                q ++;
+            }
+        }
+
+    partial:
+        line = fdec_take(p, line, avail);
+        if ((size_t)RSTRING_LEN(line) >= limit) {
+            break;
+        }
+    }
+
+    return line;
+
+found:
+    if (chomp) {
+        long len = RSTRING_LEN(line) - seplen;
+        /* IO#gets と同じく、区切りが "\n" であれば "\r\n" も取り除く */
+        if (seplen == 1 && sep[0] == '\n' && len > 0 && RSTRING_PTR(line)[len - 1] == '\r') {
+            len --;
+        }
+        rb_str_set_len(line, len);
+    }
+    return line;
+}
+
+static VALUE
+fdec_gets_args(int argc, VALUE argv[], VALUE *sep, long *limit)
+{
+    VALUE lim, opts, chomp;
+    argc = rb_scan_args(argc, argv, "02:", sep, &lim, &opts);
+    if (argc == 0) {
+        *sep = rb_rs;
+    } else if (argc == 1 && !NIL_P(*sep)) {
+        /* gets(limit) の形式 */
+        VALUE tmp = rb_check_string_type(*sep);
+        if (NIL_P(tmp)) {
+            lim = *sep;
+            *sep = rb_rs;
+        } else {
+            *sep = tmp;
+        }
+    } else if (!NIL_P(*sep)) {
+        StringValue(*sep);
+    }
+    *limit = NIL_P(lim) ? -1 : NUM2LONG(lim);
+    RBX_SCANHASH(opts, Qnil,
+            RBX_SCANHASH_ARGS("chomp", &chomp, Qfalse));
+    return chomp;
+}
+
+static VALUE
+fdec_gets_common(VALUE dec, VALUE sep, long limit, VALUE chomp)
+{
+    struct decoder *p = getdecoder(dec);
+    size_t lim = (limit < 0) ? SIZE_MAX : (size_t)limit;
+
+    if (limit == 0) {
+        return rb_str_new(NULL, 0);
+    } else if (NIL_P(sep)) {
+        if (limit > 0) {
+            return fdec_gets_sep(dec, p, "", 0, lim, 0);
+        }
+        if (!fdec_fill(dec, p)) {
+            return Qnil;
+        }
+        VALUE dest = rb_str_buf_new(0);
+        fdec_read_all(dec, p, dest);
+        return dest;
+    } else if (RSTRING_LEN(sep) == 0) {
+        /* 段落モード: 前後に続く改行は読み飛ばす */
+        fdec_swallow(dec, p, '\n');
+        VALUE line = fdec_gets_sep(dec, p, "\n\n", 2, lim, 0);
+        if (!NIL_P(line) && RSTRING_LEN(line) >= 2 && memcmp(RSTRING_END(line) - 2, "\n\n", 2) == 0) {
+            fdec_swallow(dec, p, '\n');
+            if (RTEST(chomp)) {
+                rb_str_set_len(line, RSTRING_LEN(line) - 2);
+            }
+        }
+        return line;
+    } else {
+        return fdec_gets_sep(dec, p, RSTRING_PTR(sep), RSTRING_LEN(sep), lim, RTEST(chomp));
+    }
+}
+
+/*
+ * call-seq:
+ *  gets(sep = $/, chomp: false) -> string or nil
+ *  gets(limit, chomp: false) -> string or nil
+ *  gets(sep, limit, chomp: false) -> string or nil
+ *
+ * 区切り文字列 sep までを読み込んで返します。終端に達していれば nil を返します。
+ *
+ * sep が nil であれば残りのすべてを読み込みます。
+ * sep が空文字列であれば段落モードとなり、IO#gets と同じく連続する改行を段落の区切りとして扱います。
+ *
+ * limit を与えた場合は、区切りに達していなくても limit バイトで打ち切ります。
+ *
+ * 戻り値の文字列は常にバイナリ (ASCII-8BIT) です。
+ */
+static VALUE
+fdec_gets(int argc, VALUE argv[], VALUE dec)
+{
+    VALUE sep;
+    long limit;
+    VALUE chomp = fdec_gets_args(argc, argv, &sep, &limit);
+    return fdec_gets_common(dec, sep, limit, chomp);
+}
+
+/*
+ * call-seq:
+ *  each_line(sep = $/, limit = nil, chomp: false) { |line| ... } -> self
+ *  each_line(sep = $/, limit = nil, chomp: false) -> enumerator
+ *
+ * 終端に達するまで gets を繰り返します。
+ */
+static VALUE
+fdec_each_line(int argc, VALUE argv[], VALUE dec)
 {
-    return getref(dec, &decoder_type);
+    RETURN_ENUMERATOR(dec, argc, argv);
+
+    VALUE sep, line;
+    long limit;
+    VALUE chomp = fdec_gets_args(argc, argv, &sep, &limit);
+    if (limit == 0) {
+        rb_raise(rb_eArgError, "invalid limit: 0 for each_line");
+    }
+    while (!NIL_P(line = fdec_gets_common(dec, sep, limit, chomp))) {
+        rb_yield(line);
+    }
+
+    return dec;
 }
 
-static inline VALUE
-aux_read(VALUE obj, size_t size, VALUE buf)
+/*
+ * 長さ lensize バイトのリトルエンディアン整数で前置されたレコードを読み込む。
+ */
+static VALUE
+fdec_read_record_common(VALUE dec, struct decoder *p, int lensize)
 {
-    if (NIL_P(buf) || RB_OBJ_FROZEN(buf)) {
-        buf = rb_str_buf_new(size);
+    unsigned char buf[8];
+    size_t s = fdec_read_decode(dec, p, (char *)buf, lensize);
+    if (s == 0) {
+        return Qnil;
+    }
+    if (s < (size_t)lensize) {
+        rb_raise(extlz4_eError, "truncated record length");
     }
 
-    if (NIL_P(AUX_FUNCALL(obj, id_read, SIZET2NUM(size), buf))) {
-        return Qnil;
-    } else {
-        if ((size_t)RSTRING_LEN(buf) > size) {
-            rb_raise(rb_eRuntimeError, "most read (%d, but expected to %d)", (int)RSTRING_LEN(buf), (int)size);
+    uint64_t len = 0;
+    int i;
+    for (i = lensize - 1; i >= 0; i --) {
+        len = (len << 8) | buf[i];
+    }
+    if (len > (uint64_t)LONG_MAX) {
+        rb_raise(extlz4_eError, "record too large - %llu bytes", (unsigned long long)len);
+    }
+
+    /*
+     * 長さは信頼できない入力から得たものなので、一度に確保せずブロック長ずつ倍々に拡張する。
+     * 壊れた長さであっても、実際に展開できた分しか確保しない。
+     */
+    size_t blocksize = fdec_blocksize(p);
+    VALUE rec = rb_str_buf_new(len < blocksize ? len : blocksize);
+    size_t got = 0;
+    while (got < len) {
+        size_t capa = rb_str_capacity(rec);
+        if (capa <= got) {
+            capa = got * 2;
+            aux_str_reserve(rec, (capa < len) ? capa : len);
         }
-        return buf;
+        if (capa > len) { capa = len; }
+        size_t s = fdec_read_decode(dec, p, RSTRING_PTR(rec) + got, capa - got);
+        if (s == 0) {
+            rb_raise(extlz4_eError, "truncated record (expected %llu bytes)", (unsigned long long)len);
+        }
+        got += s;
+        rb_str_set_len(rec, got);
+    }
+
+    return rec;
+}
+
+static int
+fdec_record_lensize(int argc, VALUE argv[])
+{
+    VALUE lensize;
+    rb_scan_args(argc, argv, "01", &lensize);
+    int n = NIL_P(lensize) ? 4 : NUM2INT(lensize);
+    if (n != 1 && n != 2 && n != 4 && n != 8) {
+        rb_raise(rb_eArgError, "wrong length size - %d (expect 1, 2, 4 or 8)", n);
     }
+    return n;
 }
 
 /*
  * call-seq:
- *  initialize(inport) -> self
+ *  read_record(lensize = 4) -> string or nil
  *
- * [inport]
- *  An I/O (liked) object for data read from LZ4 Frame.
+ * lensize バイトのリトルエンディアン符号なし整数で長さが前置されたレコードを一つ読み込み、
+ * その内容を返します。終端に達していれば nil を返します。
  *
- *  This object need +.read+ method.
+ * lensize は 1、2、4、8 のいずれかです。
  */
 static VALUE
-fdec_init(int argc, VALUE argv[], VALUE dec)
+fdec_read_record(int argc, VALUE argv[], VALUE dec)
+{
+    int lensize = fdec_record_lensize(argc, argv);
+    return fdec_read_record_common(dec, getdecoder(dec), lensize);
+}
+
+/*
+ * call-seq:
+ *  each_record(lensize = 4) { |record| ... } -> self
+ *  each_record(lensize = 4) -> enumerator
+ *
+ * 終端に達するまで read_record を繰り返します。
+ */
+static VALUE
+fdec_each_record(int argc, VALUE argv[], VALUE dec)
 {
+    RETURN_ENUMERATOR(dec, argc, argv);
+
+    int lensize = fdec_record_lensize(argc, argv);
     struct decoder *p = getdecoder(dec);
-    VALUE inport;
-    //VALUE readblocksize;
-    rb_scan_args(argc, argv, "1", &inport);
-    LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&p->decoder, LZ4F_VERSION);
-    aux_lz4f_check_error(err);
-    p->inport = inport;
-    p->readbuf = rb_str_buf_new(0);
-    char *readp;
-    size_t readsize;
-    size_t zero = 0;
-    size_t s = 4; /* magic number size of lz4 frame */
-    int i;
-    for (i = 0; i < 2; i ++) {
-        /*
-         * first step: check magic number
-         * second step: check frame information
-         */
-        aux_read(inport, s, p->readbuf);
-        aux_str_getmem(p->readbuf, &readp, &readsize);
-        if (!readp || readsize < s) {
-            rb_raise(extlz4_eError,
-                     "unexpected EOF (read error) - #<%s:%p>",
-                     rb_obj_classname(inport), (const void *)inport);
-        }
-        s = LZ4F_decompress(p->decoder, NULL, &zero, readp, &readsize, NULL);
-        aux_lz4f_check_error(s);
+    VALUE rec;
+    while (!NIL_P(rec = fdec_read_record_common(dec, p, lensize))) {
+        rb_yield(rec);
     }
-    p->status = s;
-    s = LZ4F_getFrameInfo(p->decoder, &p->info, NULL, &zero);
-    aux_lz4f_check_error(s);
-    p->outbuf = rb_str_tmp_new(1 << (8 + p->info.blockSizeID * 2));
-    rb_str_set_len(p->outbuf, 0);
 
     return dec;
 }
 
-static inline void
-fdec_read_args(int argc, VALUE argv[], size_t *size, VALUE *buf)
+static VALUE
+fdec_close(VALUE dec)
 {
-    switch (argc) {
-    case 0:
-        *size = ~(size_t)0;
-        *buf = rb_str_buf_new(0);
-        break;
-    case 1:
-        *size = NUM2SIZET(argv[0]);
-        *buf = rb_str_buf_new(*size);
-        break;
-    case 2:
-        *size = NUM2SIZET(argv[0]);
-        *buf = argv[1];
-        rb_check_type(*buf, RUBY_T_STRING);
-        aux_str_reserve(*buf, *size);
-        rb_str_set_len(*buf, 0);
-        break;
-    default:
-        rb_error_arity(argc, 0, 2);
+    struct decoder *p = getdecoder(dec);
+    p->status = 0;
+    p->nextframe = 0;
+    if (!NIL_P(p->outbuf)) {
+        rb_str_set_len(p->outbuf, 0);
     }
+    fdec_unmap(p);
+    // TODO: destroy decoder
+    return dec;
 }
 
+/*
+ * シーク用索引から求めた、全フレームのブロックの位置。
+ */
+struct fdec_index
+{
+    size_t nblocks;
+    uint64_t total;         /* 展開後の全体の長さ */
+    uint64_t *frameoff;     /* ブロックを含むフレームの入力上の位置 */
+    uint64_t *blockoff;     /* ブロックの入力上の位置 */
+    uint64_t *pos;          /* ブロックの展開後の位置 */
+};
+
 static void
-fdec_read_fetch(VALUE dec, struct decoder *p)
+fdec_index_free(struct fdec_index *idx)
 {
-    if (NIL_P(p->inbuf)) {
-        p->inbuf = rb_str_tmp_new(256);
-        rb_str_set_len(p->inbuf, 0);
+    if (idx) {
+        xfree(idx->frameoff);
+        xfree(idx->blockoff);
+        xfree(idx->pos);
+        xfree(idx);
+    }
+}
+
+static uint64_t
+fdec_input_size(struct decoder *p)
+{
+    if (p->mapped) {
+        return p->mapsize;
+    } else {
+        return NUM2ULL(rb_funcall2(p->inport, id_size, 0, NULL));
     }
+}
 
-    while ((size_t)RSTRING_LEN(p->inbuf) < p->status) {
-        p->readbuf = aux_read(p->inport, p->status - RSTRING_LEN(p->inbuf), p->readbuf);
-        if (NIL_P(p->readbuf)) {
-            rb_raise(rb_eRuntimeError,
-                    "unexpected EOF (read error) - #<%s:%p>",
-                    rb_obj_classname(p->inport), (const void *)p->inport);
+/*
+ * 入力の読み込み位置を off へ移し、読み込み済みのデータを捨てる。
+ */
+static void
+fdec_input_seek(struct decoder *p, uint64_t off)
+{
+    if (p->mapped) {
+        if (off > p->mapsize) {
+            fdec_raise_eof(p);
         }
-        rb_check_type(p->readbuf, RUBY_T_STRING);
-        rb_str_buf_cat(p->inbuf, RSTRING_PTR(p->readbuf), RSTRING_LEN(p->readbuf));
+        p->mapoff = off;
+    } else {
+        VALUE v = ULL2NUM(off);
+        rb_funcall2(p->inport, id_seek, 1, &v);
     }
 
-    char *inp;
-    size_t insize;
-    aux_str_getmem(p->inbuf, &inp, &insize);
-    char *outp = RSTRING_PTR(p->outbuf);
-    size_t outsize = rb_str_capacity(p->outbuf);
-    p->status = LZ4F_decompress(p->decoder, outp, &outsize, inp, &insize, NULL);
-    aux_lz4f_check_error(p->status);
-    memmove(RSTRING_PTR(p->inbuf), RSTRING_PTR(p->inbuf) + insize, RSTRING_LEN(p->inbuf) - insize);
-    rb_str_set_len(p->inbuf, RSTRING_LEN(p->inbuf) - insize);
-    rb_str_set_len(p->outbuf, outsize);
-    p->outoff = 0;
-    rb_thread_check_ints();
+    rb_str_set_len(p->inbuf, 0);
+    p->inoff = 0;
+    if (!NIL_P(p->blockbuf)) {
+        rb_str_set_len(p->blockbuf, 0);
+    }
+    p->skipleft = 0;
 }
 
-static size_t
-fdec_read_decode(VALUE dec, struct decoder *p, char *dest, size_t size)
+/*
+ * 入力の off の位置から size バイトを読み込み、その先頭を返す。
+ *
+ * 割り当てられたメモリであれば直接指し示し、そうでなければ *keep に読み込む。
+ * inbuf は変更しない。
+ */
+static const char *
+fdec_pread(struct decoder *p, uint64_t off, size_t size, VALUE *keep)
 {
-    const char *const desthead = dest;
-    uintptr_t desttail = (uintptr_t)dest + size;
+    if (p->mapped) {
+        if (off > p->mapsize || p->mapsize - off < size) {
+            fdec_raise_eof(p);
+        }
+        return p->mapped + off;
+    }
 
-    while ((uintptr_t)dest < desttail) {
-        if ((ssize_t)p->status < 1 && RSTRING_LEN(p->outbuf) < 1) {
+    VALUE v = ULL2NUM(off);
+    rb_funcall2(p->inport, id_seek, 1, &v);
+    *keep = rb_str_buf_new(size);
+    if (fdec_input(p, *keep, size) < size) {
+        fdec_raise_eof(p);
+    }
+    return RSTRING_PTR(*keep);
+}
+
+/*
+ * 入力の終端から遡ってシーク用索引を読み込む。
+ *
+ * 索引を持つフレームが start (最初のフレームの入力上の位置) まで途切れずに連なっていなければ、
+ * 展開後の位置を正しく求められないため NULL を返す。
+ * 索引のないフレームやスキップ可能フレームが間にある場合がこれにあたる。
+ *
+ * concat: false であれば最初のフレームの索引だけを用いる。
+ */
+static struct fdec_index *
+fdec_index_load(struct decoder *p, uint64_t start)
+{
+    VALUE segments = rb_ary_new();
+    uint64_t cur = fdec_input_size(p);
+    size_t nblocks = 0;
+
+    while (cur >= 8 + AUX_SEEK_INDEX_FOOTER) {
+        VALUE keep = Qnil;
+        const char *q = fdec_pread(p, cur - AUX_SEEK_INDEX_FOOTER, AUX_SEEK_INDEX_FOOTER, &keep);
+        if (aux_read_le32(q + 12) != AUX_SEEK_INDEX_SIGNATURE) {
             break;
         }
-
-        if (p->status > 0 && p->outoff >= (size_t)RSTRING_LEN(p->outbuf)) {
-            fdec_read_fetch(dec, p);
+        uint64_t headersize = aux_read_le32(q);
+        uint64_t trailersize = aux_read_le32(q + 4);
+        uint64_t n = aux_read_le32(q + 8);
+        if (cur < 8 + n * 8 + AUX_SEEK_INDEX_FOOTER) {
+            break;
+        }
+        uint64_t indexoff = cur - (8 + n * 8 + AUX_SEEK_INDEX_FOOTER);
+        q = fdec_pread(p, indexoff, 8 + n * 8, &keep);
+        if (aux_read_le32(q) != AUX_SEEK_INDEX_MAGIC ||
+                aux_read_le32(q + 4) != n * 8 + AUX_SEEK_INDEX_FOOTER) {
+            break;
         }
 
-        if (size < RSTRING_LEN(p->outbuf) - p->outoff) {
-            memcpy(dest, RSTRING_PTR(p->outbuf) + p->outoff, size);
-            p->outoff += size;
-            dest += size;
+        uint64_t framesize = headersize + trailersize;
+        size_t i;
+        for (i = 0; i < n; i ++) {
+            framesize += aux_read_le32(q + 8 + i * 8);
+        }
+        if (indexoff < framesize) {
             break;
-        } else {
-            size_t s = RSTRING_LEN(p->outbuf) - p->outoff;
-            memcpy(dest, RSTRING_PTR(p->outbuf) + p->outoff, s);
-            p->outoff = 0;
-            rb_str_set_len(p->outbuf, 0);
-            dest += s;
-            size -= s;
         }
+
+        cur = indexoff - framesize;
+        rb_ary_push(segments, rb_ary_new_from_args(3,
+                    ULL2NUM(cur), ULL2NUM(headersize), rb_str_new(q + 8, n * 8)));
+        nblocks += n;
+        RB_GC_GUARD(keep);
     }
 
-    return dest - desthead;
+    if (RARRAY_LEN(segments) < 1 || cur != start) {
+        return NULL;
+    }
+    if (!p->concat) {
+        segments = rb_ary_new_from_args(1, rb_ary_entry(segments, -1));
+        nblocks = RSTRING_LEN(RARRAY_AREF(RARRAY_AREF(segments, 0), 2)) / 8;
+    }
+
+    struct fdec_index *idx = ZALLOC(struct fdec_index);
+    idx->frameoff = ALLOC_N(uint64_t, nblocks + 1);
+    idx->blockoff = ALLOC_N(uint64_t, nblocks + 1);
+    idx->pos = ALLOC_N(uint64_t, nblocks + 1);
+
+    long j;
+    for (j = RARRAY_LEN(segments) - 1; j >= 0; j --) {
+        VALUE seg = RARRAY_AREF(segments, j);
+        uint64_t frameoff = NUM2ULL(RARRAY_AREF(seg, 0));
+        uint64_t off = frameoff + NUM2ULL(RARRAY_AREF(seg, 1));
+        VALUE ents = RARRAY_AREF(seg, 2);
+        const char *q = RSTRING_PTR(ents);
+        const char *qq = RSTRING_END(ents);
+        for (; q < qq; q += 8) {
+            idx->frameoff[idx->nblocks] = frameoff;
+            idx->blockoff[idx->nblocks] = off;
+            idx->pos[idx->nblocks] = idx->total;
+            idx->nblocks ++;
+            off += aux_read_le32(q);
+            idx->total += aux_read_le32(q + 4);
+        }
+    }
+
+    return idx;
 }
 
 /*
- * call-seq:
- *  read -> string
- *  read(size) -> string
- *  read(size, buffer) -> buffer
+ * シーク用索引を返す。まだ読み込んでいなければ読み込む。
  */
-static VALUE
-fdec_read(int argc, VALUE argv[], VALUE dec)
+static struct fdec_index *
+fdec_index_get(struct decoder *p)
 {
-    struct decoder *p = getdecoder(dec);
-    size_t size;
-    VALUE dest;
-    fdec_read_args(argc, argv, &size, &dest);
-    if (size == 0) {
-        return dest;
+    if (!p->index) {
+        VALUE saved = Qnil;
+        uint64_t start = p->firstframe;
+        if (!p->mapped) {
+            saved = rb_funcall2(p->inport, id_pos, 0, NULL);
+            /* inport の現在位置から、読み込みを始めた位置を求める */
+            start += NUM2ULL(saved) - p->inread;
+        }
+        p->index = fdec_index_load(p, start);
+        if (!p->index) {
+            if (!NIL_P(saved)) {
+                rb_funcall2(p->inport, id_seek, 1, &saved);
+            }
+            rb_raise(extlz4_eError,
+                     "seek index not found, or not covering all frames (encode with index: true) - #<%s:%p>",
+                     rb_obj_classname(p->inport), (const void *)p->inport);
+        }
     }
 
-    if (p->status == 0) {
-        return Qnil;
+    return p->index;
+}
+
+/*
+ * 展開後の位置 pos へ移動する。
+ *
+ * pos を含むブロックだけを展開し、その途中から読み込めるようにする。
+ */
+static void
+fdec_seek_pos(VALUE dec, struct decoder *p, uint64_t pos)
+{
+    struct fdec_index *idx = fdec_index_get(p);
+    p->pos = pos;
+
+    if (pos >= idx->total) {
+        p->status = 0;
+        p->nextframe = 0;
+        rb_str_set_len(p->outbuf, 0);
+        p->outoff = 0;
+        return;
     }
 
-    if ((ssize_t)size > 0) {
-        char *destp = RSTRING_PTR(dest);
-        size_t destsize = size;
-        destsize = fdec_read_decode(dec, p, destp, destsize);
-        rb_str_set_len(dest, destsize);
-    } else {
-        const size_t tmpsize = 4 * 1024 * 1024;
-        VALUE tmpbuf = rb_str_tmp_new(tmpsize);
-        char *tmp = RSTRING_PTR(tmpbuf);
-        size_t s;
-        rb_str_set_len(dest, 0);
-        while ((s = fdec_read_decode(dec, p, tmp, tmpsize)) > 0) {
-            rb_str_buf_cat(dest, tmp, s);
+    /* pos を含むブロックを二分探索する */
+    size_t lo = 0, hi = idx->nblocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->pos[mid] <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
-        rb_str_resize(tmpbuf, 0);
     }
 
+    fdec_input_seek(p, idx->frameoff[lo]);
+    fdec_read_header(p, 1);
+    fdec_begin_frame(p);
+    if (p->info.blockMode != LZ4F_blockIndependent) {
+        rb_raise(extlz4_eError,
+                 "seek index refers to a linked-block frame - #<%s:%p>",
+                 rb_obj_classname(p->inport), (const void *)p->inport);
+    }
 
-    if (RSTRING_LEN(dest) > 0) {
-        return dest;
-    } else {
-        return Qnil;
+    /* フレームの途中から展開するため、内容のチェックサムと長さは検証できない */
+    p->manual = 1;
+    p->seeked = 1;
+    if (!p->mapped && NIL_P(p->blockbuf)) {
+        p->blockbuf = rb_str_buf_new(0);
     }
+
+    fdec_input_seek(p, idx->blockoff[lo]);
+    fdec_fetch_outbuf(p);
+    p->outoff = pos - idx->pos[lo];
+    rb_thread_check_ints();
 }
 
 /*
  * call-seq:
- *  getc -> String | nil
+ *  pos -> integer
+ *  tell -> integer
  *
- * Read one byte character.
+ * 展開後のデータにおける現在の位置を返します。
  */
 static VALUE
-fdec_getc(VALUE dec)
+fdec_pos(VALUE dec)
 {
-    struct decoder *p = getdecoder(dec);
-
-    if (p->status == 0) {
-        return Qnil;
-    }
-
-    char ch;
-    size_t s = fdec_read_decode(dec, p, &ch, 1);
-    if (s > 0) {
-        VALUE v = rb_str_new(&ch, 1);
-        return v;
-    } else {
-        return Qnil;
-    }
+    return ULL2NUM(getdecoder(dec)->pos);
 }
 
 /*
  * call-seq:
- *  getbyte -> Integer | nil
+ *  seek(offset, whence = IO::SEEK_SET) -> 0
  *
- * Read one byte code integer.
+ * 展開後のデータにおける位置を移動します。
+ *
+ * 入力の末尾にシーク用索引 (LZ4::Encoder の index: true) が必要です。
+ * 入力は LZ4::Decoder.open や LZ4::Decoder.decode で与えたものか、
+ * seek と size メソッドを持つ IO (liked) オブジェクトでなければなりません。
+ *
+ * 目的の位置を含む独立ブロックだけが展開されます。
+ * シークした後のフレームでは、内容のチェックサムは検証されません。
  */
 static VALUE
-fdec_getbyte(VALUE dec)
+fdec_seek(int argc, VALUE argv[], VALUE dec)
 {
     struct decoder *p = getdecoder(dec);
+    VALUE offset, whence;
+    rb_scan_args(argc, argv, "11", &offset, &whence);
+    int64_t off = NUM2LL(offset);
+    int w = NIL_P(whence) ? SEEK_SET : NUM2INT(whence);
 
-    char ch;
-    size_t s = fdec_read_decode(dec, p, &ch, 1);
-    if (s > 0) {
-        return INT2FIX(ch);
-    } else {
-        return Qnil;
+    switch (w) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        off += (int64_t)p->pos;
+        break;
+    case SEEK_END:
+        off += (int64_t)fdec_index_get(p)->total;
+        break;
+    default:
+        rb_raise(rb_eArgError, "wrong whence - %d", w);
     }
+
+    if (off < 0) {
+        rb_syserr_fail(EINVAL, "LZ4::Decoder#seek");
+    }
+
+    fdec_seek_pos(dec, p, (uint64_t)off);
+
+    return INT2FIX(0);
 }
 
+/*
+ * call-seq:
+ *  pos = integer
+ *
+ * seek(integer) と等価です。
+ */
 static VALUE
-fdec_close(VALUE dec)
+fdec_set_pos(VALUE dec, VALUE pos)
 {
-    struct decoder *p = getdecoder(dec);
-    p->status = 0;
-    // TODO: destroy decoder
-    return dec;
+    fdec_seek(1, &pos, dec);
+    return pos;
 }
 
 static VALUE
 fdec_eof(VALUE dec)
 {
     struct decoder *p = getdecoder(dec);
-    if (p->status == 0) {
+    if (fdec_eof_p(p)) {
         return Qtrue;
     } else {
         return Qfalse;
@@ -686,10 +3669,32 @@ fdec_inport(VALUE dec)
     return getdecoder(dec)->inport;
 }
 
-static int
-fdec_blocksize(struct decoder *p)
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * 展開器の統計情報をハッシュとして返します。
+ *
+ * [bytes_in]           inport から消費したバイト数
+ * [bytes_out]          展開されたバイト数
+ * [blocks]             処理したブロック数
+ * [stored_blocks]      圧縮されずに格納されていたブロック数
+ * [decompress_time]    展開処理に費やした秒数
+ * [input_time]         inport からの読み込みに費やした秒数
+ *
+ * LZ4::Decoder.open で開いた場合、input_time はメモリ上に割り当てたファイルから複写した時間です。
+ * 割り当てた領域から直接展開する間のファイルの読み込みは decompress_time に含まれます。
+ */
+static VALUE
+fdec_stats(VALUE dec)
 {
-    return aux_frame_blocksize(&p->info);
+    return aux_stats_to_hash(&getdecoder(dec)->stats, "decompress_time", "input_time");
+}
+
+static VALUE
+fdec_dictionary(VALUE dec)
+{
+    return getdecoder(dec)->dictionary;
 }
 
 static VALUE
@@ -727,24 +3732,43 @@ fdec_inspect(VALUE dec)
     }
 }
 
-/*** setup for LZ4::Encoder and LZ4::Decoder ***/
+/*** setup for LZ4::Dictionary, LZ4::Encoder and LZ4::Decoder ***/
 
 void
 extlz4_init_frameapi(void)
 {
     id_op_lshift = rb_intern("<<");
     id_read = rb_intern("read");
+    id_write = rb_intern("write");
+    id_binmode_p = rb_intern("binmode?");
+    id_cctx_pool = rb_intern("__extlz4_cctx_pool__");
+    id_seek = rb_intern("seek");
+    id_size = rb_intern("size");
+    id_pos = rb_intern("pos");
+
+    VALUE cDictionary = rb_define_class_under(extlz4_mLZ4, "Dictionary", rb_cObject);
+    rb_define_alloc_func(cDictionary, fdic_alloc);
+    rb_define_method(cDictionary, "initialize", RUBY_METHOD_FUNC(fdic_init), -1);
+    rb_define_method(cDictionary, "data", RUBY_METHOD_FUNC(fdic_data), 0);
+    rb_define_method(cDictionary, "dictid", RUBY_METHOD_FUNC(fdic_dictid), 0);
+    rb_define_method(cDictionary, "size", RUBY_METHOD_FUNC(fdic_size), 0);
+    rb_define_method(cDictionary, "inspect", RUBY_METHOD_FUNC(fdic_inspect), 0);
 
     VALUE cEncoder = rb_define_class_under(extlz4_mLZ4, "Encoder", rb_cObject);
     rb_define_alloc_func(cEncoder, fenc_alloc);
     rb_define_method(cEncoder, "initialize", RUBY_METHOD_FUNC(fenc_init), -1);
     rb_define_method(cEncoder, "write", RUBY_METHOD_FUNC(fenc_write), -1);
     rb_define_method(cEncoder, "<<", RUBY_METHOD_FUNC(fenc_push), 1);
+    rb_define_method(cEncoder, "write_raw", RUBY_METHOD_FUNC(fenc_write_raw), 1);
     rb_define_method(cEncoder, "flush", RUBY_METHOD_FUNC(fenc_flush), 0);
     rb_define_method(cEncoder, "close", RUBY_METHOD_FUNC(fenc_close), 0);
     rb_define_alias(cEncoder, "finish", "close");
+    rb_define_singleton_method(cEncoder, "encode", RUBY_METHOD_FUNC(fenc_s_encode), -1);
+    rb_define_method(cEncoder, "reset", RUBY_METHOD_FUNC(fenc_reset), -1);
     rb_define_method(cEncoder, "outport", RUBY_METHOD_FUNC(fenc_getoutport), 0);
     rb_define_method(cEncoder, "outport=", RUBY_METHOD_FUNC(fenc_setoutport), 1);
+    rb_define_method(cEncoder, "dictionary", RUBY_METHOD_FUNC(fenc_dictionary), 0);
+    rb_define_method(cEncoder, "stats", RUBY_METHOD_FUNC(fenc_stats), 0);
     rb_define_method(cEncoder, "prefs_level", RUBY_METHOD_FUNC(fenc_prefs_level), 0);
     rb_define_method(cEncoder, "prefs_blocksize", RUBY_METHOD_FUNC(fenc_prefs_blocksize), 0);
     rb_define_method(cEncoder, "prefs_blocklink", RUBY_METHOD_FUNC(fenc_prefs_blocklink), 0);
@@ -753,14 +3777,26 @@ extlz4_init_frameapi(void)
 
     VALUE cDecoder = rb_define_class_under(extlz4_mLZ4, "Decoder", rb_cObject);
     rb_define_alloc_func(cDecoder, fdec_alloc);
+    rb_define_singleton_method(cDecoder, "open", RUBY_METHOD_FUNC(fdec_s_open), -1);
+    rb_define_singleton_method(cDecoder, "decode", RUBY_METHOD_FUNC(fdec_s_decode), -1);
     rb_define_method(cDecoder, "initialize", RUBY_METHOD_FUNC(fdec_init), -1);
     rb_define_method(cDecoder, "read", RUBY_METHOD_FUNC(fdec_read), -1);
     rb_define_method(cDecoder, "getc", RUBY_METHOD_FUNC(fdec_getc), 0);
     rb_define_method(cDecoder, "getbyte", RUBY_METHOD_FUNC(fdec_getbyte), 0);
+    rb_define_method(cDecoder, "gets", RUBY_METHOD_FUNC(fdec_gets), -1);
+    rb_define_method(cDecoder, "each_line", RUBY_METHOD_FUNC(fdec_each_line), -1);
+    rb_define_method(cDecoder, "read_record", RUBY_METHOD_FUNC(fdec_read_record), -1);
+    rb_define_method(cDecoder, "each_record", RUBY_METHOD_FUNC(fdec_each_record), -1);
     rb_define_method(cDecoder, "close", RUBY_METHOD_FUNC(fdec_close), 0);
     rb_define_alias(cDecoder, "finish", "close");
     rb_define_method(cDecoder, "eof", RUBY_METHOD_FUNC(fdec_eof), 0);
+    rb_define_method(cDecoder, "pos", RUBY_METHOD_FUNC(fdec_pos), 0);
+    rb_define_method(cDecoder, "tell", RUBY_METHOD_FUNC(fdec_pos), 0);
+    rb_define_method(cDecoder, "pos=", RUBY_METHOD_FUNC(fdec_set_pos), 1);
+    rb_define_method(cDecoder, "seek", RUBY_METHOD_FUNC(fdec_seek), -1);
     rb_define_method(cDecoder, "inport", RUBY_METHOD_FUNC(fdec_inport), 0);
+    rb_define_method(cDecoder, "dictionary", RUBY_METHOD_FUNC(fdec_dictionary), 0);
+    rb_define_method(cDecoder, "stats", RUBY_METHOD_FUNC(fdec_stats), 0);
     rb_define_alias(cDecoder, "eof?", "eof");
     rb_define_method(cDecoder, "prefs_blocksize", RUBY_METHOD_FUNC(fdec_prefs_blocksize), 0);
     rb_define_method(cDecoder, "prefs_blocklink", RUBY_METHOD_FUNC(fdec_prefs_blocklink), 0);
@@ -0,0 +1,119 @@
+#include "extlz4.h"
+
+#ifdef HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+
+/*
+ * GVL を手放した状態で func(arg, index, worker) を index = 0 ... njobs - 1 について呼び出す。
+ *
+ * 呼び出し元のスレッドも worker = 0 として処理に加わり、
+ * 追加で最大 threads - 1 本のネイティブスレッドを生成する。
+ * worker は 0 ... threads - 1 の範囲で、同時に同じ値を持つスレッドは存在しない。
+ *
+ * スレッドが生成できなかった場合、残りの処理は呼び出し元のスレッドが行う。
+ *
+ * ruby の API を呼び出してはならない。
+ */
+
+#ifdef HAVE_PTHREAD_H
+
+struct parallel
+{
+    extlz4_parallel_f *func;
+    void *arg;
+    size_t njobs;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+struct parallel_worker
+{
+    struct parallel *parallel;
+    int worker;
+};
+
+static void
+parallel_loop(struct parallel *p, int worker)
+{
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        size_t index = p->next ++;
+        pthread_mutex_unlock(&p->lock);
+
+        if (index >= p->njobs) {
+            break;
+        }
+
+        p->func(p->arg, index, worker);
+    }
+}
+
+static void *
+parallel_worker_main(void *pp)
+{
+    struct parallel_worker *w = pp;
+    parallel_loop(w->parallel, w->worker);
+    return NULL;
+}
+
+void
+extlz4_parallel_run(int threads, size_t njobs, extlz4_parallel_f *func, void *arg)
+{
+    if (threads < 2 || njobs < 2) {
+        size_t i;
+        for (i = 0; i < njobs; i ++) {
+            func(arg, i, 0);
+        }
+        return;
+    }
+
+    if ((size_t)threads > njobs) {
+        threads = (int)njobs;
+    }
+
+    struct parallel p = {
+        .func = func,
+        .arg = arg,
+        .njobs = njobs,
+        .next = 0,
+    };
+    pthread_t ths[threads - 1];
+    struct parallel_worker workers[threads - 1];
+    int i, nths = 0;
+
+    pthread_mutex_init(&p.lock, NULL);
+
+    for (i = 0; i < threads - 1; i ++) {
+        workers[i].parallel = &p;
+        workers[i].worker = i + 1;
+        if (pthread_create(&ths[i], NULL, parallel_worker_main, &workers[i]) != 0) {
+            break;
+        }
+        nths ++;
+    }
+
+    parallel_loop(&p, 0);
+
+    for (i = 0; i < nths; i ++) {
+        pthread_join(ths[i], NULL);
+    }
+
+    pthread_mutex_destroy(&p.lock);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+void
+extlz4_parallel_run(int threads, size_t njobs, extlz4_parallel_f *func, void *arg)
+{
+    size_t i;
+
+    (void)threads;
+
+    for (i = 0; i < njobs; i ++) {
+        func(arg, i, 0);
+    }
+}
+
+#endif /* HAVE_PTHREAD_H */
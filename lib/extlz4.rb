@@ -18,7 +18,7 @@ module LZ4
 
   #
   # call-seq:
-  #   decode_file(inpath, outpath) -> nil
+  #   decode_file(inpath, outpath, opts = {}) -> nil
   #
   # Decode lz4 file to regular file.
   #
@@ -31,13 +31,21 @@ module LZ4
   # [outpath]
   #   Give output file path, or output IO (liked) object its has ``<<'' method.
   #
-  def self.decode_file(inpath, outpath)
-    open_file(inpath, "rb") do |infile|
-      decode(infile) do |lz4|
-        open_file(outpath, "wb") do |outfile|
-          inbuf = ""
-          slicesize = 1 << 20
-          outfile << inbuf while lz4.read(slicesize, inbuf)
+  # [opts = {} (Hash)]
+  #   See LZ4::Decoder#initialize.
+  #
+  #   threads: に 2 以上を与えると、独立ブロックのフレームを並列に展開します。
+  #
+  def self.decode_file(inpath, outpath, **opts)
+    if inpath.kind_of?(String)
+      # a path is mapped into memory and decoded in place
+      LZ4::Decoder.open(inpath, **opts) do |lz4|
+        decode_file_to(lz4, outpath)
+      end
+    else
+      open_file(inpath, "rb") do |infile|
+        decode(infile, **opts) do |lz4|
+          decode_file_to(lz4, outpath)
         end
       end
     end
@@ -45,6 +53,16 @@ module LZ4
     nil
   end
 
+  def self.decode_file_to(lz4, outpath)
+    open_file(outpath, "wb") do |outfile|
+      inbuf = ""
+      slicesize = 1 << 20
+      outfile << inbuf while lz4.read(slicesize, inbuf)
+    end
+  end
+
+  private_class_method :decode_file_to
+
   #
   # call-seq:
   #   encode_file(inpath, outpath, level = 1, opts = {}) -> nil
@@ -95,7 +113,7 @@ module LZ4
   def self.open_file(file, mode)
     case
     when file.kind_of?(String)
-      File.open(file, mode, &proc)
+      File.open(file, mode) { |f| yield(f) }
     when file.respond_to?(:binmode)
       file.binmode rescue nil
       yield(file)
@@ -131,6 +149,30 @@ module LZ4
   # [checksum: true (true or false)]
   #   ストリーム全体のチェックサム (XXhash32) の有効・無効を切り替えます。
   #
+  # [threads: nil (Integer)]
+  #   blocklink: false の場合に、ブロックの圧縮処理を並列に行うスレッド数を指定します。
+  #
+  #   出力されるデータは並列化しない場合と同一です。
+  #
+  # [adaptive: false (true or false)]
+  #   真を与えた場合、圧縮と出力に要した時間から圧縮レベルをブロックごとに切り替えます。
+  #
+  #   blocklink: false の時のみ有効です。ストリーム圧縮の場合にのみ意味があります。
+  #
+  # [skip_incompressible: false (true or false)]
+  #   真を与えた場合、圧縮済みの画像や暗号化されたデータのように圧縮できそうにないブロックを、圧縮を試みずに格納します。
+  #
+  #   blocklink: false の時のみ有効です。
+  #
+  # [index: false (true or false)]
+  #   真を与えた場合、フレームの直後にシーク用索引を出力します。
+  #   展開時に LZ4::Decoder#seek や LZ4::Decoder#pos= で任意の位置へ移動できるようになります。
+  #
+  #   blocklink: false の時のみ有効です。
+  #
+  # [dictionary: nil (LZ4::Dictionary)]
+  #   事前辞書を指定します。展開する時には LZ4.decode に同じ辞書を与える必要があります。
+  #
   # ==== encode(source_string, level = 1, opts = {}) -> encoded_data
   #
   # Basic encode method.
@@ -143,6 +185,8 @@ module LZ4
   #
   #   文字符号情報は無視されて純粋なバイナリデータ列として処理されます。
   #
+  #   LZ4::Encoder.encode によって一度に圧縮され、フレームヘッダには source_string の長さが記録されます。
+  #
   # ==== encode(output_io, level = 1, opts = {}) -> encoder
   #
   # Available streaming LZ4 Frame encode.
@@ -203,12 +247,7 @@ module LZ4
         lz4.close
       end
     else
-      obj = args.shift
-      outport = "".force_encoding(Encoding::BINARY)
-      lz4 = LZ4::Encoder.new(outport, *args, **opts)
-      lz4 << obj
-      lz4.close
-      outport
+      LZ4::Encoder.encode(*args, **opts)
     end
   end
 
@@ -220,6 +259,8 @@ module LZ4
   #
   # Decode LZ4 Frame data. This is available streaming process.
   #
+  # 事前辞書を用いて圧縮されたデータであれば、dictionary: に同じ LZ4::Dictionary を与えてください。
+  #
   # ==== decode(encoded_data_string)
   #
   # [RETURN (String)]
@@ -259,15 +300,12 @@ module LZ4
   #     end
   #   end
   #
-  def self.decode(obj, *args)
+  def self.decode(obj, *args, **opts)
     if obj.kind_of?(String)
-      lz4 = Decoder.new(StringIO.new(obj), *args)
-      dest = lz4.read
-      lz4.close
-      return (dest || "".b)
+      return Decoder.decode(obj, *args, **opts)
     end
 
-    lz4 = Decoder.new(obj, *args)
+    lz4 = Decoder.new(obj, *args, **opts)
     return lz4 unless block_given?
 
     begin
@@ -277,19 +315,19 @@ module LZ4
     end
   end
 
-  def self.block_encode(*args)
-    BlockEncoder.encode(*args)
+  def self.block_encode(*args, **opts)
+    BlockEncoder.encode(*args, **opts)
   end
 
-  def self.block_decode(*args)
-    BlockDecoder.decode(*args)
+  def self.block_decode(*args, **opts)
+    BlockDecoder.decode(*args, **opts)
   end
 
   #
   # Call LZ4::BlockEncoder.new.
   #
-  def self.block_stream_encode(*args)
-    lz4 = BlockEncoder.new(*args)
+  def self.block_stream_encode(*args, **opts)
+    lz4 = BlockEncoder.new(*args, **opts)
     return lz4 unless block_given?
 
     begin
@@ -302,8 +340,8 @@ module LZ4
   #
   # Call LZ4::BlockDecoder.new.
   #
-  def self.block_stream_decode(*args)
-    lz4 = BlockDecoder.new(*args)
+  def self.block_stream_decode(*args, **opts)
+    lz4 = BlockDecoder.new(*args, **opts)
     return lz4 unless block_given?
 
     begin
@@ -342,12 +380,12 @@ module LZ4
       LZ4.decode self, *args, &block
     end
 
-    def to_lz4block(*args)
-      LZ4.block_encode(self, *args)
+    def to_lz4block(*args, **opts)
+      LZ4.block_encode(self, *args, **opts)
     end
 
-    def unlz4block(*args)
-      LZ4.block_decode(self, *args)
+    def unlz4block(*args, **opts)
+      LZ4.block_decode(self, *args, **opts)
     end
   end
 
@@ -77,6 +77,112 @@ class TestBlockAPI < Test::Unit::TestCase
     assert_raise(TypeError) { LZ4.block_encode(src, "bad-maxsize", "a") } # "bad-maxsize" is not integer
   end
 
+  def test_block_encode_batch
+    srcs = SAMPLES.values.map { |s| s.byteslice(0, 50000) } + ["".b, "abc".b]
+    [nil, -5, 0, 9].each do |level|
+      blocks = LZ4::BlockEncoder.encode_batch(srcs, level, threads: 3)
+      assert_equal(srcs, blocks.map { |b| LZ4.block_decode(b) })
+      assert_equal(LZ4.block_encode(level, srcs[0]), blocks[0])
+
+      packed, offsets = LZ4::BlockEncoder.encode_batch(srcs, level, packed: true)
+      assert_equal(blocks.join, packed)
+      assert_equal(srcs.size + 1, offsets.size)
+      assert_equal(blocks[1], packed.byteslice(offsets[1] ... offsets[2]))
+    end
+    assert_equal([], LZ4::BlockEncoder.encode_batch([]))
+    assert_raise(TypeError) { LZ4::BlockEncoder.encode_batch(["a", 1]) }
+  end
+
+  def test_block_decode_batch
+    srcs = SAMPLES.values.map { |s| s.byteslice(0, 50000) } + ["".b, "abc".b]
+    blocks = LZ4::BlockEncoder.encode_batch(srcs)
+    assert_equal(srcs, LZ4::BlockDecoder.decode_batch(blocks))
+    assert_equal(srcs, LZ4::BlockDecoder.decode_batch(blocks, 50000, threads: 3))
+    assert_equal(srcs, LZ4::BlockDecoder.decode_batch(blocks, srcs.map(&:bytesize)))
+
+    packed, offsets = LZ4::BlockDecoder.decode_batch(blocks, 60000, threads: 2, packed: true)
+    assert_equal(srcs.join, packed)
+    assert_equal(srcs[1], packed.byteslice(offsets[1] ... offsets[2]))
+
+    assert_raise(LZ4::Error) { LZ4::BlockDecoder.decode_batch(blocks, 10) }
+    assert_raise(LZ4::Error) { LZ4::BlockDecoder.decode_batch([blocks[0], SAMPLES["\\xaa (small size)"]]) }
+    assert_raise(ArgumentError) { LZ4::BlockDecoder.decode_batch(blocks, [1, 2]) }
+  end
+
+  def test_block_stream_encode_ring
+    r = Random.new(5)
+    words = %w(alpha beta gamma delta epsilon zeta eta theta)
+    msgs = (0...500).map { |i| (0...(i % 50 == 0 ? 30000 : r.rand(300))).map { words[r.rand(8)] }.join(" ").b }
+    [nil, -3, 9].each do |level|
+      lz4 = LZ4::BlockEncoder.new(level, ring: true)
+      dec = LZ4::BlockDecoder.new
+      out = msgs.each_with_index.map do |m, i|
+        lz4.savedict if i == 250
+        dec.update(lz4.update(m))
+      end
+      assert_equal(msgs, out)
+    end
+    assert_match(/high compression 9/, LZ4::BlockEncoder.new(9, ring: true).inspect)
+  end
+
+  def test_block_stream_decode_ring
+    r = Random.new(7)
+    words = %w(alpha beta gamma delta epsilon zeta eta theta)
+    msgs = (0...800).map { |i| (0...(i % 100 == 99 ? 40000 : r.rand(1500))).map { words[r.rand(8)] }.join(" ").b }
+    predict = words.join(" ") * 100
+    [[], [predict]].each do |dict|
+      lz4 = LZ4::BlockEncoder.new(nil, *dict)
+      blocks = msgs.map { |m| lz4.update(m) }
+      dec = LZ4::BlockDecoder.new(*dict, ring: true)
+      assert_equal(msgs, blocks.map { |b| dec.update(b) })
+      dec.reset
+      assert_equal(msgs, blocks.map { |b| dec.update(b, 400000) })
+    end
+  end
+
+  def test_block_size_prefix
+    data = SAMPLES["\\0 (small size)"] + "abcdefg" * 50000
+    [nil, -5, 9].each do |level|
+      src = LZ4.block_encode(level, data, size_prefix: true)
+      size = src.unpack("C5").each_with_index.inject(0) { |a, (b, i)| break a | (b << (i * 7)) if b < 0x80; a | ((b & 0x7f) << (i * 7)) }
+      assert_equal(data.bytesize, size)
+      assert_equal(data, LZ4.block_decode(src, size_prefix: true))
+      assert_equal(data, LZ4.block_decode(src, data.bytesize, "", size_prefix: true))
+      assert_raise(LZ4::Error) { LZ4.block_decode(src, data.bytesize - 1, size_prefix: true) }
+    end
+    assert_equal("", LZ4.block_decode(LZ4.block_encode("", size_prefix: true), size_prefix: true))
+    assert_raise(LZ4::Error) { LZ4.block_decode("\x80\x80", size_prefix: true) }
+    assert_raise(LZ4::Error) { LZ4.block_decode("\x05\x40abcd", size_prefix: true) }
+    assert_raise(LZ4::Error) { LZ4.block_decode("\x80\x80\x80\x01\x00", size_prefix: true) }
+    assert_raise(TypeError) { LZ4.block_decode(LZ4.block_encode(data), { size_prefix: true }) }
+    assert_raise(TypeError) { LZ4::BlockEncoder.encode(data, { size_prefix: true }) }
+
+    msgs = (0...300).map { |i| ("%d:" % i) * (i * 7 % 5000) }
+    [false, true].each do |ring|
+      lz4 = LZ4::BlockEncoder.new(nil, size_prefix: true, ring: ring)
+      blocks = msgs.map { |m| lz4.update(m) }
+      dec = LZ4::BlockDecoder.new(size_prefix: true, ring: ring)
+      assert_equal(msgs, blocks.map { |b| dec.update(b) })
+      dec = LZ4.block_stream_decode(size_prefix: true)
+      assert_equal(msgs, blocks.map { |b| dec.update(b, 100000) })
+    end
+  end
+
+  def test_block_stream_encode_deadline
+    data = SAMPLES["random (big size)"].byteslice(0, 100000) + "abcdefg" * 10000
+    lz4 = LZ4::BlockEncoder.new(12, deadline: 1e-9)
+    dec = LZ4::BlockDecoder.new
+    3.times { assert_equal(data, dec.update(lz4.update(data))) }
+    assert_raise(ArgumentError) { LZ4::BlockEncoder.new(12, deadline: -1) }
+
+    # level 0 is LZ4HC_CLEVEL_DEFAULT; only the first update is compressed at that level
+    text = (0...20000).map { |i| "line #{i * 7 % 1013} " }.join
+    lz4 = LZ4::BlockEncoder.new(0, deadline: 1e-9)
+    ref = LZ4::BlockEncoder.new(0)
+    assert_equal(ref.update(data), lz4.update(data))
+    assert_not_equal(ref.update(text), lz4.update(text))
+  end
+
   def test_block_decode
     src = LZ4.block_encode(SAMPLES["\\0 (small size)"])
     buf = ""
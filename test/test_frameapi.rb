@@ -30,6 +30,7 @@
 
 require "test-unit"
 require "extlz4"
+require "tempfile"
 
 require_relative "common"
 
@@ -40,6 +41,523 @@ class TestFrameAPI < Test::Unit::TestCase
     })
   end
 
+  SAMPLES.each_pair do |name, data|
+    define_method("test_encode_threads_sample:#{name}", -> {
+      [1, 9].each do |level|
+        assert_equal(LZ4.encode(data, level, blocksize: 256 * 1024),
+                     LZ4.encode(data, level, blocksize: 256 * 1024, threads: 4))
+      end
+    })
+  end
+
+  def test_encode_threads_streaming
+    data = SAMPLES["random (big size)"].byteslice(0, 1000000) + SAMPLES["\\xaa (big size)"]
+    outs = [nil, 3].map do |threads|
+      lz4 = LZ4::Encoder.new("".b, threads: threads)
+      lz4 << data.byteslice(0, 1000)
+      lz4 << data.byteslice(1000, 300000)
+      lz4.flush
+      lz4 << data.byteslice(301000 .. -1)
+      lz4.close
+      lz4.outport
+    end
+    assert_equal(outs[0], outs[1])
+    assert_equal(data, LZ4.decode(outs[1]))
+    assert_equal(4 * 1024 * 1024, LZ4::Encoder.new.prefs_blocksize)
+    assert_equal(64 * 1024, LZ4::Encoder.new(threads: 3).prefs_blocksize)
+    assert_equal(4 * 1024 * 1024, LZ4::Encoder.new(threads: 1).prefs_blocksize)
+    assert_equal(4 * 1024 * 1024, LZ4::Encoder.new(threads: 0).prefs_blocksize)
+  end
+
+  def test_encode_oneshot
+    data = SAMPLES["\\xaa (small size)"]
+    lz4 = LZ4::Encoder.encode(data)
+    assert_equal(Encoding::BINARY, lz4.encoding)
+    assert_equal(0x08, lz4.getbyte(4) & 0x08) # content size flag
+    assert_equal([data.bytesize].pack("Q<"), lz4.byteslice(6, 8))
+    assert_equal(data, LZ4.decode(lz4))
+    assert_equal(data, LZ4.decode(LZ4::Encoder.encode(data, 9, blocklink: true, checksum: false)))
+    assert_equal(data, LZ4.decode(LZ4::Encoder.encode(data, threads: 2)))
+    assert_raise(TypeError) { LZ4::Encoder.encode(nil) }
+  end
+
+  def test_encode_oneshot_threads
+    data = SAMPLES["random (small size)"] + SAMPLES["\\xaa (small size)"]
+    expect = LZ4.encode(data)
+    4.times.map { Thread.new { 20.times.map { LZ4.encode(data) } } }.each do |th|
+      th.value.each { |d| assert_equal(expect, d) }
+    end
+
+    # the cached contexts are per thread, not per fiber
+    Thread.new {
+      LZ4.encode(data)
+      LZ4.block_encode(data)
+      assert_equal(expect, Fiber.new { LZ4.encode(data) }.resume)
+      assert_empty(Thread.current.keys)
+    }.join
+  end
+
+  def test_encoder_reset
+    [nil, 2].each do |threads|
+      lz4 = LZ4::Encoder.new("".b, 1, threads: threads)
+      lz4 << "abcdefg" * 1000
+      outs = SAMPLES.values.map do |data|
+        dest = "".b
+        assert_same(lz4, lz4.reset(dest))
+        assert_same(dest, lz4.outport)
+        lz4 << data
+        lz4.close
+        dest
+      end
+      SAMPLES.values.zip(outs) do |data, dest|
+        assert_equal(data, LZ4.decode(dest))
+      end
+    end
+  end
+
+  def test_dictionary
+    dict = LZ4::Dictionary.new(%({"id":0,"name":"","email":"","created_at":"2024-01-01T00:00:00Z"}) * 20, 1234)
+    assert_predicate(dict, :frozen?)
+    assert_equal(1234, dict.dictid)
+    data = %({"id":1,"name":"alice","email":"alice@example.com","created_at":"2024-02-03T04:05:06Z"})
+    [{}, { blocklink: true }, { threads: 2 }].each do |opts|
+      d1 = LZ4.encode(data, dictionary: dict, **opts)
+      d2 = LZ4::Encoder.new("".b, dictionary: dict, **opts).tap { |lz4| lz4 << data; lz4.close }.outport
+      assert_operator(d1.bytesize, :<, LZ4.encode(data, **opts).bytesize)
+      assert_equal(data, LZ4.decode(d1, dictionary: dict))
+      assert_equal(data, LZ4.decode(d2, dictionary: dict))
+    end
+    assert_raise(LZ4::Error) { LZ4.decode(LZ4.encode(data, dictionary: dict)) }
+    assert_raise(TypeError) { LZ4.encode(data, dictionary: "abc") }
+  end
+
+  def test_encode_adaptive
+    data = SAMPLES["\\xaa (big size)"].byteslice(0, 2000000)
+    slow = Object.new
+    slow.instance_variable_set(:@buf, "".b)
+    def slow.<<(buf)
+      sleep 0.02
+      @buf << buf
+      self
+    end
+    def slow.buf
+      @buf
+    end
+    lz4 = LZ4::Encoder.new(slow, 1, adaptive: true)
+    lz4 << data
+    lz4.close
+    assert_operator(lz4.prefs_level, :>, 1)
+    assert_equal(data, LZ4.decode(slow.buf))
+
+    lz4 = LZ4::Encoder.new("".b, 1, adaptive: true)
+    (0 ... data.bytesize).step(100000) { |off| lz4 << data.byteslice(off, 100000) }
+    lz4.close
+    assert_equal(data, LZ4.decode(lz4.outport))
+
+    assert_raise(ArgumentError) { LZ4::Encoder.new("".b, adaptive: true, blocklink: true) }
+  end
+
+  def test_encode_deadline
+    data = SAMPLES["random (big size)"].byteslice(0, 1000000) + "abcdefg" * 100000
+    # 圧縮速度の見積もりがない最初のブロックは本来の圧縮レベルで圧縮される
+    [[nil, 1], [2, 2]].each do |threads, full|
+      lz4 = LZ4::Encoder.new("".b, 12, blocksize: 64 * 1024, threads: threads, deadline: 1e-9)
+      lz4 << data
+      lz4.close
+      assert_equal(lz4.stats[:blocks] - full, lz4.stats[:fallback_blocks])
+      assert_equal(data, LZ4.decode(lz4.outport))
+    end
+
+    lz4 = LZ4::Encoder.new("".b, 12, blocksize: 64 * 1024, threads: 2, deadline: 1000)
+    lz4 << data
+    lz4.close
+    assert_equal(0, lz4.stats[:fallback_blocks])
+    assert_equal(data, LZ4.decode(lz4.outport))
+
+    assert_equal(data, LZ4.decode(LZ4::Encoder.encode(data, 9, deadline: 1e-9)))
+    assert_raise(ArgumentError) { LZ4::Encoder.new("".b, deadline: 1, blocklink: true) }
+    assert_raise(ArgumentError) { LZ4::Encoder.new("".b, deadline: 0) }
+  end
+
+  def test_stats
+    data = SAMPLES["random (big size)"].byteslice(0, 65536) + "abcdefg" * 30000
+    [nil, 2].each do |threads|
+      lz4 = LZ4::Encoder.new("".b, 1, blocksize: 64 * 1024, threads: threads)
+      lz4 << data
+      lz4.close
+      st = lz4.stats
+      assert_equal(data.bytesize, st[:bytes_in])
+      assert_equal(lz4.outport.bytesize, st[:bytes_out])
+      assert_equal((data.bytesize + 65535) / 65536, st[:blocks])
+      assert_equal(1, st[:stored_blocks])
+      assert_kind_of(Float, st[:compress_time])
+      assert_kind_of(Float, st[:output_time])
+
+      dec = LZ4::Decoder.new(StringIO.new(lz4.outport))
+      assert_equal(data, dec.read)
+      st2 = dec.stats
+      assert_equal(lz4.outport.bytesize, st2[:bytes_in])
+      assert_equal(data.bytesize, st2[:bytes_out])
+      assert_equal(st[:blocks], st2[:blocks])
+      assert_equal(st[:stored_blocks], st2[:stored_blocks])
+      assert_kind_of(Float, st2[:decompress_time])
+      assert_kind_of(Float, st2[:input_time])
+    end
+  end
+
+  def test_skip_incompressible
+    random = SAMPLES["random (big size)"].byteslice(0, 1000000)
+    text = "abcdefg" * 100000
+    lz4 = LZ4::Encoder.new("".b, 9, skip_incompressible: true)
+    lz4 << random << text
+    lz4.close
+    st = lz4.stats
+    assert_equal(random.bytesize / 65536, st[:stored_blocks])
+    assert_operator(st[:bytes_out], :<, random.bytesize + text.bytesize / 10)
+    assert_equal(random + text, LZ4.decode(lz4.outport))
+
+    assert_equal(random, LZ4.decode(LZ4.encode(random, skip_incompressible: true)))
+    assert_raise(ArgumentError) { LZ4::Encoder.new("".b, skip_incompressible: true, blocklink: true) }
+  end
+
+  def test_write_raw
+    data1 = "abcdefg" * 10000
+    data2 = SAMPLES["random (big size)"].byteslice(0, 200000)
+    lz4 = LZ4::Encoder.new("".b, checksum: false)
+    lz4 << data1
+    assert_same(lz4, lz4.write_raw(data2))
+    lz4 << data1
+    lz4.close
+    assert_equal(4, lz4.stats[:stored_blocks])
+    assert_equal(data1 + data2 + data1, LZ4.decode(lz4.outport))
+
+    lz4 = LZ4::Encoder.new("".b)
+    lz4.write_raw(data2)
+    lz4 << data1
+    lz4.close
+    assert_equal(data2 + data1, LZ4.decode(lz4.outport))
+
+    # 既定の checksum: true でも、圧縮したデータの後から切り替えられる
+    lz4 = LZ4::Encoder.new("".b)
+    lz4 << data1
+    lz4.write_raw(data2)
+    lz4 << data1
+    lz4.close
+    assert_equal(data1 + data2 + data1, LZ4.decode(lz4.outport))
+    broken = lz4.outport.dup
+    broken.setbyte(-1, broken.getbyte(-1) ^ 1)
+    assert_raise(LZ4::Error, RuntimeError) { LZ4.decode(broken) }
+    lz4.reset
+    lz4 << data1
+    lz4.close
+    assert_equal(data1, LZ4.decode(lz4.outport))
+
+    assert_raise(LZ4::Error) { LZ4::Encoder.new("".b, blocklink: true).write_raw("abc") }
+  end
+
+  def test_encode_to_file
+    data = SAMPLES["\\xaa (big size)"] + SAMPLES["random (small size)"]
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << "header"
+      LZ4.encode(file) do |lz4|
+        lz4 << data.byteslice(0, 300000)
+        lz4.flush
+        lz4 << data.byteslice(300000 .. -1)
+      end
+      file.rewind
+      assert_equal("header", file.read(6))
+      assert_equal(data, LZ4.decode(file.read))
+    end
+  end
+
+  def test_encode_to_io_with_write_override
+    received = 0
+    outport = Class.new(File) {
+      define_method(:write) { |*s| received += s.sum(&:bytesize); super(*s) }
+    }
+    data = SAMPLES["\\xaa (small size)"]
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "sample.lz4")
+      outport.open(path, "wb") { |file| LZ4.encode(file) { |lz4| lz4 << data } }
+      assert_equal(File.size(path), received)
+      assert_equal(data, LZ4.decode(File.binread(path)))
+    end
+  end
+
+  def test_decode_from_file
+    data = SAMPLES["\\xaa (big size)"] + SAMPLES["random (small size)"]
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << "header" << LZ4.encode(data, blocksize: 64 * 1024)
+      file.rewind
+      assert_equal("header", file.read(6)) # the rest of the file stays in the IO's read buffer
+      LZ4.decode(file) do |lz4|
+        assert_equal(data.byteslice(0, 1000), lz4.read(1000))
+        assert_equal(data.byteslice(1000 .. -1), lz4.read)
+      end
+    end
+  end
+
+  def test_decoder_open
+    data = SAMPLES["\\xaa (big size)"] + SAMPLES["random (small size)"]
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << LZ4.encode(data, blocksize: 64 * 1024, checksum: true)
+      file.close
+      LZ4::Decoder.open(file.path) do |lz4|
+        assert_equal(file.path, lz4.inport)
+        assert_equal(data.byteslice(0, 1000), lz4.read(1000))
+        assert_equal(data.byteslice(1000 .. -1), lz4.read)
+        assert_equal(File.size(file.path), lz4.stats[:bytes_in])
+      end
+
+      Tempfile.create("extlz4", binmode: true) do |out|
+        out.close
+        assert_nil(LZ4.decode_file(file.path, out.path))
+        assert_equal(data, File.binread(out.path))
+        assert_nil(LZ4.decode_file(file.path, out.path, threads: 4))
+        assert_equal(data, File.binread(out.path))
+      end
+    end
+
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << LZ4.encode(data).byteslice(0, 1000)
+      file.close
+      assert_raise(RuntimeError) { LZ4::Decoder.open(file.path, &:read) }
+    end
+  end
+
+  def test_decode_oneshot
+    SAMPLES.each_pair do |name, data|
+      lz4 = LZ4.encode(data)
+      dest = LZ4::Decoder.decode(lz4)
+      assert_equal(data, dest, name)
+      assert_equal(Encoding::BINARY, dest.encoding, name)
+      assert_equal(data, LZ4::Decoder.new(StringIO.new(lz4)).read || "".b, name)
+
+      lz4 = LZ4.encode(StringIO.new("".b)) { |e| e << data }.string
+      assert_equal(data, LZ4::Decoder.decode(lz4), name)
+    end
+
+    data = SAMPLES["\\xaa (big size)"]
+    lz4 = LZ4.encode(data)
+    assert_raise(RuntimeError) { LZ4::Decoder.decode(lz4.byteslice(0, lz4.bytesize / 2)) }
+    assert_equal(data, LZ4.decode(lz4.freeze))
+  end
+
+  def test_decode_lines_and_records
+    lines = (0...20000).map { |i| "line #{i}" + "x" * (i % 97) + "\r\n" }
+    data = lines.join.b
+    lz4 = LZ4.encode(data, blocksize: 64 * 1024)
+    assert_equal(lines, LZ4::Decoder.new(StringIO.new(lz4)).each_line.to_a)
+    assert_equal(lines.map(&:chomp), LZ4::Decoder.new(StringIO.new(lz4)).each_line("\r\n", chomp: true).to_a)
+    dec = LZ4::Decoder.new(StringIO.new(lz4))
+    assert_equal(lines[0], dec.gets)
+    assert_equal(lines[1].byteslice(0, 2), dec.read(2))
+    assert_equal(lines[1].byteslice(2..-1), dec.gets("\r\n"))
+    assert_equal(lines[2..-1].join, dec.gets(nil))
+    assert_nil(dec.gets)
+
+    # 区切りがブロックの境界をまたぐ場合は、最も手前から始まる区切りで切る
+    data = ("h" * 65533 + "\r\n\r" + "\n\r\nbody").b
+    lz4 = LZ4.encode(data, blocksize: 64 * 1024)
+    assert_equal(StringIO.new(data).each_line("\r\n\r\n").to_a,
+                 LZ4::Decoder.new(StringIO.new(lz4)).each_line("\r\n\r\n").to_a)
+    data = ("h" * 65535 + "\r" + "\n" * 65536 + "\r\nbody").b
+    lz4 = LZ4.encode(data, blocksize: 64 * 1024)
+    sep = "\r" + "\n" * 65536 + "\r\n"
+    assert_equal(["h" * 65535 + sep, "body"], LZ4::Decoder.new(StringIO.new(lz4)).each_line(sep).to_a)
+
+    data = "\n\na\nb\n\n\n\nc\n\n".b
+    lz4 = LZ4.encode(data)
+    assert_equal(["a\nb\n\n", "c\n\n"], LZ4::Decoder.new(StringIO.new(lz4)).each_line("").to_a)
+    assert_equal(["a\nb", "c"], LZ4::Decoder.new(StringIO.new(lz4)).each_line("", chomp: true).to_a)
+    assert_equal(StringIO.new(data).each_line("\n", 3).to_a, LZ4::Decoder.new(StringIO.new(lz4)).each_line(3).to_a)
+    dec = LZ4::Decoder.new(StringIO.new(lz4))
+    assert_equal("\n\na", dec.gets(nil, 3))
+    assert_equal("\nb\n", dec.gets("\n\n", 3))
+    assert_raise(ArgumentError) { dec.each_line(0) { } }
+
+    records = (0...5000).map { |i| "record #{i}".b * (i % 37) }
+    lz4 = LZ4.encode(records.map { |r| [r.bytesize].pack("V") + r }.join, blocksize: 64 * 1024)
+    assert_equal(records, LZ4::Decoder.new(StringIO.new(lz4)).each_record.to_a)
+    lz4 = LZ4.encode(records.map { |r| [r.bytesize].pack("v") + r }.join)
+    assert_equal(records, LZ4::Decoder.new(StringIO.new(lz4)).each_record(2).to_a)
+    assert_raise(LZ4::Error) { LZ4::Decoder.new(StringIO.new(LZ4.encode("\x10\0\0\0abc"))).read_record }
+    assert_raise(LZ4::Error) { LZ4::Decoder.new(StringIO.new(LZ4.encode([1 << 62].pack("Q<") + "abc"))).read_record(8) }
+  end
+
+  def test_decode_read_sizes
+    data = SAMPLES["\\xaa (big size)"].byteslice(0, 1000000) + SAMPLES["random (big size)"].byteslice(0, 1000000)
+    lz4 = LZ4.encode(data, blocksize: 64 * 1024, checksum: true)
+    bs = 64 * 1024
+    sizes = [bs - 1, bs, 1, bs + 1, 3 * bs + 7, 100]
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << lz4
+      file.close
+      [
+        -> { LZ4::Decoder.new(StringIO.new(lz4)) },
+        -> { LZ4::Decoder.new(StringIO.new(lz4), threads: 3) },
+        -> { LZ4::Decoder.open(file.path) },
+      ].each do |mk|
+        dec = mk.()
+        buf = "".b
+        dest = "".b
+        i = 0
+        while dec.read(sizes[i % sizes.size], buf)
+          dest << buf
+          i += 1
+        end
+        assert_equal(data, dest)
+        dec.close
+      end
+    end
+  end
+
+  def test_decode_short_reads
+    # returns at most 7 bytes per call
+    reader = Class.new do
+      def initialize(src)
+        @src = src
+        @pos = 0
+      end
+
+      def read(size, buf = "".b)
+        return nil if @pos >= @src.bytesize
+        buf.replace(@src.byteslice(@pos, [size, 1 + @pos % 7].min))
+        @pos += buf.bytesize
+        buf
+      end
+    end
+
+    data = SAMPLES["\\xaa (small size)"] + SAMPLES["random (small size)"]
+    lz4 = LZ4.encode(data, blocksize: 64 * 1024, checksum: true)
+    assert_equal(data, LZ4::Decoder.new(reader.new(lz4)).read)
+    assert_equal(data, LZ4::Decoder.new(reader.new(lz4), threads: 2).read)
+  end
+
+  def test_decode_concatenated_frames
+    skippable = [0x184D2A53, 5].pack("VV") + "extra"
+    a = SAMPLES["\\xaa (big size)"].byteslice(0, 300000)
+    b = SAMPLES["random (small size)"]
+    c = SAMPLES["\\0 (big size)"].byteslice(0, 200000)
+    lz4 = skippable +
+          LZ4.encode(a) +
+          LZ4.encode(StringIO.new("".b), checksum: true, blocksize: 64 * 1024) { |e| e << b }.string +
+          skippable + LZ4.encode("") +
+          LZ4.encode(c, blocklink: true) + skippable
+    data = a + b + c
+
+    assert_equal(data, LZ4.decode(lz4, concat: true))
+    assert_equal(data, LZ4.decode(lz4, threads: 3, concat: true))
+    assert_equal(a, LZ4.decode(lz4))
+    assert_equal(lz4.bytesize, LZ4::Decoder.new(StringIO.new(lz4), concat: true).tap(&:read).stats[:bytes_in])
+
+    dec = LZ4::Decoder.new(StringIO.new(lz4), concat: true)
+    dest = "".b
+    buf = "".b
+    dest << buf while dec.read(70000, buf)
+    assert_equal(data, dest)
+    assert(dec.eof?)
+
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << lz4
+      file.close
+      assert_equal(data, LZ4::Decoder.open(file.path, concat: true, &:read))
+    end
+
+    assert_raise(LZ4::Error) { LZ4.decode(LZ4.encode(a) + "garbage", concat: true) }
+    assert_equal(a, LZ4.decode(LZ4.encode(a) + "garbage"))
+  end
+
+  def test_seek_index
+    a = SAMPLES["random (big size)"].byteslice(0, 300000)
+    b = SAMPLES["\\xaa (big size)"].byteslice(0, 500000)
+    lz4 = LZ4.encode(a, blocksize: 64 * 1024, index: true) +
+          LZ4.encode(StringIO.new("".b), blocksize: 64 * 1024, index: true) { |e|
+            e << b.byteslice(0, 100000)
+            e.write_raw(b.byteslice(100000, 100000))
+            e << b.byteslice(200000 .. -1)
+          }.string
+    data = a + b
+    assert_equal(data, LZ4.decode(lz4, concat: true))
+
+    Tempfile.create("extlz4", binmode: true) do |file|
+      file << lz4
+      file.close
+      [
+        -> { LZ4::Decoder.new(StringIO.new(lz4), concat: true) },
+        -> { LZ4::Decoder.new(StringIO.new(lz4), threads: 2, concat: true) },
+        -> { LZ4::Decoder.open(file.path, concat: true) },
+      ].each do |mk|
+        dec = mk.()
+        [[123456, 1000], [299990, 20], [0, 10], [650000, 100000], [400000, 0]].each do |pos, size|
+          dec.pos = pos
+          assert_equal(pos, dec.pos)
+          assert_equal(data.byteslice(pos, size), dec.read(size)) if size > 0
+          assert_equal(pos + size, dec.pos)
+        end
+        dec.seek(-10, IO::SEEK_END)
+        assert_equal(data.byteslice(-10, 10), dec.read)
+        dec.seek(100, IO::SEEK_END)
+        assert_nil(dec.read(10))
+        dec.seek(-data.bytesize - 100, IO::SEEK_CUR)
+        assert_equal(data, dec.read)
+        dec.close
+      end
+    end
+
+    skippable = [0x184D2A50, 3].pack("VV") + "abc"
+    dec = LZ4::Decoder.new(StringIO.new(skippable + lz4), concat: true)
+    dec.pos = 300010
+    assert_equal(data.byteslice(300010, 100), dec.read(100))
+    dec = LZ4::Decoder.new(StringIO.new(lz4))
+    dec.seek(-10, IO::SEEK_END)
+    assert_equal(a.byteslice(-10, 10), dec.read)
+    [LZ4.encode(b) + lz4, LZ4.encode(a, blocksize: 64 * 1024, index: true).then { |fa| fa + skippable + lz4.byteslice(fa.bytesize .. -1) }].each do |broken|
+      dec = LZ4::Decoder.new(StringIO.new(broken), concat: true)
+      assert_raise(LZ4::Error) { dec.seek(10) }
+    end
+
+    dec = LZ4::Decoder.new(StringIO.new(LZ4.encode(a)))
+    assert_raise(LZ4::Error) { dec.seek(10) }
+    assert_equal(a, dec.read)
+    assert_raise(ArgumentError) { LZ4.encode(a, blocklink: true, index: true) }
+  end
+
+  def test_decode_threads
+    data = SAMPLES["\\xaa (big size)"] + SAMPLES["random (big size)"].byteslice(0, 1000000)
+    dic = LZ4::Dictionary.new(SAMPLES["random (small size)"])
+    [
+      [{ blocksize: 64 * 1024, checksum: true, skip_incompressible: true }, {}],
+      [{ blocksize: 64 * 1024, dictionary: dic }, { dictionary: dic }],
+      [{ checksum: true }, {}],
+    ].each do |eopts, dopts|
+      lz4 = LZ4.encode(data, **eopts)
+      assert_equal(data, LZ4.decode(lz4, threads: 4, **dopts))
+      dec = LZ4::Decoder.new(StringIO.new(lz4), threads: 3, **dopts)
+      assert_equal(data.byteslice(0, 1000), dec.read(1000))
+      assert_equal(data.byteslice(1000 .. -1), dec.read)
+      assert_nil(dec.read)
+      assert_equal(lz4.bytesize, dec.stats[:bytes_in])
+    end
+
+    small = SAMPLES["\\xaa (small size)"]
+    assert_equal(small, LZ4.decode(LZ4.encode(small), threads: 4))
+
+    lz4 = LZ4.encode(data, checksum: true)
+    lz4.setbyte(-1, lz4.getbyte(-1) ^ 1)
+    assert_raise(LZ4::Error) { LZ4.decode(lz4, threads: 4) }
+  end
+
+  def test_decode_from_pipe
+    data = SAMPLES["random (big size)"].byteslice(0, 1000000)
+    IO.pipe do |r, w|
+      r.binmode
+      th = Thread.new { w.binmode; w << LZ4.encode(data, blocksize: 64 * 1024); w.close }
+      assert_equal(data, LZ4.decode(r) { |lz4| lz4.read })
+      th.join
+    end
+  end
+
   def test_encode_args
     assert_kind_of(LZ4::Encoder, LZ4.encode)
     assert_kind_of(LZ4::Encoder, LZ4.encode(StringIO.new("")))